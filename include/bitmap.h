@@ -2,6 +2,7 @@
 #define BITMAP_H
 /*
     Responsible for managing and manipulating the bitmap.
+    Every function here takes the allocator lock, so blocks can be allocated and freed from any thread.
 */
 
 #include <stdio.h>
@@ -9,42 +10,55 @@
 #include <unistd.h>
 #include <stdint.h>
 #include <stdlib.h>
-#include <math.h>
 
 #include "disk.h"
 
 #define MAP_BLOCK (8)
+#define ALLOC_SCAN_RUNS (64)     // free runs `allocBlocks` looks at before settling for the longest
 
 extern int diskfd;
 
-uint64_t bmap_size;     // Size of BITMAP in bytes
-uint8_t *bitmap;
+extern uint64_t bmap_size;     // Size of BITMAP in bytes
+extern uint8_t *bitmap;
 
 /*
 Load bitmap from file via `fd` and place the pointer in global `bitmap`. Also fill `bmap_size` to indicate size of bitmap. Bitmap is always stored just after the superblock in the disk.
+With the mmap backend `bitmap` points into the mapped disk file instead of a copy.
 */
 int loadBitMap(int fd);
 
 /*
-Save bitmap to file via `fd` from the pointer global `bitmap`. Bitmap is always stored just after the superblock in the disk.
+Save the changed parts of the global `bitmap` to the disk. Only the 4 KB bitmap blocks touched by `setBitofMap` or `clearBitofMap` since the last save are written, consecutive ones with a single write. Bitmap is always stored just after the superblock in the disk.
+Nothing is written when `bitmap` points into the mapped disk file.
 */
 void saveBitMap();
 
 /*
-Find first free block in the disk, i.e, the first 0 bit in the bitmap.
+Find a free block in the disk, i.e, a 0 bit in the bitmap. The search is next-fit: it starts at the word where the previous search ended and wraps around, scanning 64 bits at a time and skipping fully used ranges of 4096 bits through a summary level. Returns -1 if the disk is full.
 */
 uint64_t findFirstFreeBlock();
 
 /*
-Set the bit `bitno` of `bitmap` to 1.
+Reserve up to `count` consecutive free blocks, setting their bits, and return the first one. The search starts at block `goal` (0 for the next-fit cursor) and wraps around; it takes the first free run long enough for `count`, or the longest of the first `ALLOC_SCAN_RUNS` runs seen. The number of blocks reserved is placed in `got`, callers wanting more call again for the rest.
+Returns -1 with `got` set to 0 if the disk is full.
+*/
+uint64_t allocBlocks(uint64_t goal, uint64_t count, uint64_t *got);
+
+/*
+Set the bit `bitno` of `bitmap` to 1. The change stays in memory until `saveBitMap` is called.
 */
 int setBitofMap(uint64_t bitno);
 
 /*
-Clear the bit `bitno` of `bitmap`, i.e, set it to 0.
+Clear the bit `bitno` of `bitmap`, i.e, set it to 0. The change stays in memory until `saveBitMap` is called.
 */
 int clearBitofMap(uint64_t bitno);
 
+/*
+Return the value of bit `bitno` of `bitmap`.
+*/
+int testBitofMap(uint64_t bitno);
+
 /*
 Print the bitmap. Each bit's value is printed. Output will not be shown unless FFS was compiled/run with `d` prefix as in `make dcompile` or `make drun`.
 */
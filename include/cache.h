@@ -0,0 +1,67 @@
+#ifndef CACHE_H
+#define CACHE_H
+/*
+    Block buffer cache sitting under readBlock and writeBlock.
+    Blocks are kept in a fixed number of slots, replaced using the CLOCK algorithm, and written back to disk only when evicted or flushed.
+    Safe to use from several threads. The cache lock is not held during disk I/O, a slot being read or written is marked busy instead and other threads wanting it wait for it.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "disk.h"
+
+#define DEFAULT_CACHE_BLOCKS (1024)     // 4 MB of cached blocks unless told otherwise at mount
+
+typedef struct cache_entry {
+    uint64_t blocknr;                   // block held in this slot
+    uint8_t *data;                      // BLOCK_SIZE bytes
+    uint8_t valid;                      // slot holds a block
+    uint8_t dirty;                      // block changed since it was read or last written back
+    uint8_t referenced;                 // CLOCK reference bit, set on every access
+    uint8_t busy;                       // disk I/O on this slot is in progress
+    int64_t next;                       // next slot in the same hash bucket, -1 for none
+}cache_entry;
+
+extern uint64_t cache_hits;         // lookups served from memory
+extern uint64_t cache_misses;       // lookups that had to go to disk
+extern uint64_t cache_writebacks;   // dirty blocks written to disk
+
+/*
+Set up a cache of `nblocks` blocks. A size of 0 disables the cache, readBlock and writeBlock then go straight to disk.
+Returns 0 if successful, else -ENOMEM.
+*/
+int initCache(uint64_t nblocks);
+
+/*
+Returns 1 if the cache has been set up, else 0.
+*/
+int cacheEnabled();
+
+/*
+Copy block `blocknr` into `block`, reading it from disk into the cache first if it isn't cached.
+Returns BLOCK_SIZE if successful, else the error from the disk read.
+*/
+int cacheRead(uint64_t blocknr, void *block);
+
+/*
+Copy `block` into the cached copy of block `blocknr` and mark it dirty. Nothing is written to disk until the block is evicted or the cache is flushed.
+Returns BLOCK_SIZE if successful, else the error from writing back an evicted block.
+*/
+int cacheWrite(uint64_t blocknr, void *block);
+
+/*
+Write every dirty block back to disk, in block order. Blocks stay cached.
+Returns 0 if successful, else a negative error, in which case the blocks stay dirty.
+*/
+int flushCache();
+
+/*
+Flush the cache and free it. Used at unmount.
+*/
+void destroyCache();
+
+#endif
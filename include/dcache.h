@@ -0,0 +1,49 @@
+#ifndef DCACHE_H
+#define DCACHE_H
+/*
+    Dentry cache sitting in front of `node_exists`, mapping full paths straight to their FS tree nodes.
+    Paths are hashed into a fixed number of slots, a path whose slot is taken replaces the entry already there.
+    Entries are only dropped by `dcacheInvalidate`, so callers removing or moving a node must invalidate its path first.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#define DCACHE_SLOTS (4096)     // number of cached paths, a power of 2
+
+struct fs_tree_node;
+
+typedef struct dcache_entry {
+    char *path;                         // full path of the node, NULL if the slot is empty
+    uint32_t hash;                      // hash of path
+    struct fs_tree_node *node;          // node at path
+}dcache_entry;
+
+extern uint64_t dcache_hits;        // lookups answered from the cache
+extern uint64_t dcache_misses;      // lookups that had to walk the tree
+
+/*
+Returns the node cached for `path`, or NULL if `path` is not cached.
+*/
+struct fs_tree_node *dcacheLookup(const char *path);
+
+/*
+Cache `node` as the node at `path`.
+*/
+void dcacheInsert(const char *path, struct fs_tree_node *node);
+
+/*
+Drop the entry for `path`. If `recursive` is set, entries for every path under `path` are dropped too, as needed when a directory is removed or renamed.
+*/
+void dcacheInvalidate(const char *path, int recursive);
+
+/*
+Drop all entries and free their memory. Used at unmount.
+*/
+void destroyDcache();
+
+#endif
@@ -16,6 +16,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include <fuse.h>
 #include "tree.h"
@@ -28,73 +29,296 @@ extern int diskfd;
 #define MAX_FILE_SIZE 18446744073709551616    // bytes, largest possible value in unsigned 64 bit int; 13.6 EB (Exabytes)
 #define MAX_BLOCK_NO 4503599627370496           //MAX_FILE_SIZE / (4*1024)
 
+#define IOV_BATCH (64)                          // blocks per preadv/pwritev call
+#define URING_DEPTH (32)                        // requests in flight on each thread's io_uring
+#define DIRECT_POOL_BLOCKS (256)                // aligned bounce buffers kept for O_DIRECT transfers
+#define WRITEBACK_BLOCKS (1024)                 // dirty blocks a file gathers before a write sends them to disk, 4 MB
+
+/*
+`count` consecutive disk blocks from `blocknr`, block `blocknr + i` transferred to or from `blocks[i]`.
+*/
+typedef struct block_run {
+    uint64_t blocknr;
+    uint64_t count;
+    void **blocks;
+}block_run;
+
+#define INODES_PER_BLOCK (10)                   // inodes mkfs packs into one block of the inode table
+#define INODE_SB_PACKING (32)                   // superblock offset of the inodes per block, 0 on older disks with one inode per block
+#define INODE_SIZE (BLOCK_SIZE / inodes_per_block)  // bytes of one inode record
+
+extern uint64_t inodes_per_block;       // INODES_PER_BLOCK, or 1 for disks made before inodes were packed
+
+#define TAIL_SLOTS (32)                         // fragments one tail block can hold
+#define TAIL_HEADER (TAIL_SLOTS * 4)            // slot directory at the start of a tail block
+#define TAIL_MAX (BLOCK_SIZE / 2)               // largest file whose data is kept in a fragment
+
 /*
-Allocate as many blocks as needed to store (n) bytes in data field of node.
-Return pointer to begin writing (in-memory).
+Entry of the slot directory of a tail block. Fragment `i` is `length` bytes at `offset` in the block, a length of 0 means the slot is free.
+Small files keep their data in a fragment of a tail block shared with other small files. Fragment `i` of block `b` is numbered `b * TAIL_SLOTS + i`.
 */
-void *allocate(fs_tree_node *node, uint64_t n);
+typedef struct tail_slot {
+    uint16_t offset;
+    uint16_t length;
+}tail_slot;
+
+#define DIR_HEADER (8)                          // zero at the start of a directory's first block, older directories start with a child inode number
+#define DIR_ENTRY_HEAD (10)                     // inode_no + type + name length, before the name
 
 /*
-Like realloc, reallocate data to have blocks needed to store (n) bytes.
-Return pointer.
+A child as listed in the blocks of its directory. On disk an entry is its inode number, type and name length followed by the name without its terminating zero, entries don't cross blocks and a zero inode number ends a block early.
+Directories written before entries had names hold only an array of child inode numbers, their entries are read with type 0 and an empty name.
 */
-void *reallocate(fs_tree_node *node, uint64_t n);
+typedef struct dir_entry {
+    uint64_t inode_no;
+    uint8_t type;                       // 1 = file, 2 = directory, 0 if unknown
+    char name[256];
+}dir_entry;
 
 /*
-Like memset for blocks. Set (n) bytes from ptr, to val.
+A block shared by several inodes or fragments, seen since mount.
+Inode `n` is record `n % inodes_per_block` of block `n / inodes_per_block` of the inode table, a record whose type byte is 0 is free.
+Table and tail blocks are allocated from the bitmap like any other block and released once nothing is left in them, so they grow and shrink with the number of files.
 */
-void *setBlocks(void *ptr, uint64_t n, int val);
+typedef struct shared_block {
+    uint64_t blocknr;                   // 0 for an empty slot of the table
+    uint32_t used;                      // bit i set if record or fragment i is in use
+    uint16_t room;                      // free bytes in a tail block
+    uint8_t valid;                      // cleared when the block is released, the slot is then kept for the same block number
+    uint8_t listed;                     // block is on the list of blocks with room left
+}shared_block;
 
 /*
-Deallocate like free.
+Shared blocks of one kind, an open addressing hash table keyed by block number and a stack of the blocks with room left.
 */
-void deallocate(fs_tree_node *node);
+typedef struct shared_table {
+    shared_block *entries;
+    uint64_t size, count;               // slots in entries, a power of 2, and slots holding a block
+    uint64_t *partial;                  // blocks that had room when listed, checked again when taken off
+    uint64_t partial_count, partial_cap;
+    pthread_mutex_t lock;               // protects the above and read-modify-writes of the blocks
+}shared_table;
 
+#define EXTENT_SIZE (24)                                            // logical + start + length, in bytes
+#define INLINE_EXTENTS ((INODE_SIZE - NODE_SIZE) / EXTENT_SIZE)     // extents stored in the inode record itself
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - 8) / EXTENT_SIZE)          // extents stored in each overflow block, after its next field
 
 /*
-Construct a block to write to disk, metadata (from fs_tree_node) + data
-Metadata = type + name + len + uid + gid + perms + nlinks + data_size + atim + mtim + ctim < + data + > + inode_no + next_block
+Return the in-memory buffer holding the new contents of file block `fblock` of `node`, creating it and marking the block dirty if it isn't already.
+A new buffer is filled with the block's current contents from disk if `fill` is set and the block is mapped, else with zeroes.
+Returns NULL if there is no memory.
+*/
+uint8_t *dirtyBlock(fs_tree_node *node, uint64_t fblock, int fill);
 
-The (block) will contain metadata and all data, last 64 bits of each block left empty to be filled at the time of flushing. The last 64 bits are used to store the block number of the next block where the rest of the data is stored.
-Returns the number of blocks allocated and built! The constructed block is placed in `ret`.
+/*
+Forget the dirty buffers of `node` from file block `from` onwards, without writing them.
 */
-uint64_t constructBlock(fs_tree_node *node, void **ret);
+void dropDirtyBlocks(fs_tree_node *node, uint64_t from);
+
+
+/*
+Construct the inode block(s) to write to disk, metadata (from fs_tree_node) + extent map
+Metadata = type + name + len + uid + gid + perms + nlinks + data_size + atim + mtim + ctim + inode_no + extent_count + ext_next
+
+The first block holds the inode record, the metadata followed by the first INLINE_EXTENTS extents, in its first INODE_SIZE bytes. Any remaining extents go into the overflow blocks listed in `node->ext_blocks`, each of which starts with the block number of the next overflow block (0 for the last one) followed by EXTENTS_PER_BLOCK extents.
+The payload itself (file data or child inode numbers) is not part of these blocks, it lives in the data blocks mapped by the extents.
+Returns the number of blocks allocated and built! The constructed block is placed in `ret`. Returns -ENOMEM if they can't be allocated.
+*/
+int64_t constructBlock(fs_tree_node *node, void **ret);
 
 /*
 Reconstruct node from block at `blockdata` and return the constructed block with all fields filled in correctly. Essentially an inverse of constructBlock.
+Only the inline extents are filled in, `node->ext_blocks[0]` holds the first overflow block to read the rest from.
 */
 fs_tree_node *reconstructNode(void *blockdata);
 
+/*
+Return the disk block holding file block `fblock` of `node`, or 0 if that block is not mapped.
+*/
+uint64_t lookupBlock(fs_tree_node *node, uint64_t fblock);
+
+/*
+Return the disk block holding file block `fblock` of `node`, allocating a free block and adding it to the extent map if it is not mapped yet.
+Returns 0 if the disk is full.
+*/
+uint64_t mapBlock(fs_tree_node *node, uint64_t fblock);
+
+/*
+Make sure file blocks `fblock` to `fblock + count - 1` of `node` are mapped. Each unmapped stretch is reserved with `allocBlocks` as one run where possible, aimed right after the disk block of the preceding file block, or after the inode for the first block, and added to the extent map as whole extents.
+Returns the number of blocks from `fblock` on that are mapped, less than `count` only if the disk is full.
+*/
+uint64_t mapBlocks(fs_tree_node *node, uint64_t fblock, uint64_t count);
+
+/*
+Release every block of `node` from file block `from` onwards, clearing their bits in the bitmap through `journalFree` and trimming the extent map.
+*/
+void unmapBlocks(fs_tree_node *node, uint64_t from);
+
+/*
+Release all blocks owned by `node` : data blocks, extent overflow blocks, its fragment and its inode.
+*/
+int freeNodeBlocks(fs_tree_node *node);
+
+/*
+Reserve a free inode and return its number, in the block of inode `goal` if it has a free record, else in another table block known to have one, else in a new table block allocated near `goal`.
+A new table block is zeroed through `journalWrite`.
+Returns 0 if the disk is full.
+*/
+uint64_t allocInode(uint64_t goal);
+
+/*
+Release inode `inode_no`, releasing its table block through `journalFree` once it holds no inode.
+*/
+void freeInode(uint64_t inode_no);
+
+/*
+Read the record of inode `inode_no` into the first INODE_SIZE bytes of `buf`, which must hold BLOCK_SIZE bytes, and zero the rest.
+The first read of a table block also notes which of its records are free, so they can be handed out by `allocInode`.
+Returns BLOCK_SIZE if successful, else a negative error.
+*/
+int readInode(uint64_t inode_no, void *buf);
+
+/*
+Write the first INODE_SIZE bytes of `record` as the record of inode `inode_no`, through `journalWrite`. The rest of its table block is left as it is.
+Returns BLOCK_SIZE if successful, else a negative error.
+*/
+int writeInode(uint64_t inode_no, void *record);
+
 /*
 Open a file to be used as a disk and return the file descriptor.
 */
 int openDisk(char *filename, int nbytes);
 
+/*
+Open `filename` a second time with O_DIRECT and use that descriptor for all whole-block transfers from then on, so block data bypasses the host page cache and only the block cache holds it. Byte ranges such as the superblock fields and the bitmap keep using the normal descriptor.
+O_DIRECT needs block aligned memory, blocks in buffers that aren't aligned go through a pool of `DIRECT_POOL_BLOCKS` aligned bounce buffers.
+Returns 0 if successful, else a negative error.
+*/
+int openDirectDisk(char *filename);
+
 /*
 Read one block of data from disk and place the data into `block`. Block number `blocknr` is read from file. Offset is calculated as `blocknr * BLOCK_SIZE`.
+Served from the block cache when it is enabled.
 */
 int readBlock(uint64_t blocknr, void *block);
 
 /*
 Write one block of data to disk from `block`. Block number `blocknr` is written in file. Offset is calculated as `blocknr * BLOCK_SIZE`.
+When the block cache is enabled the block is only written to the cache, and reaches the disk when evicted or flushed.
 */
 int writeBlock(uint64_t blocknr, void *block);
 
 /*
-Essentially a wrapper for writing block data at the first free disk block given by `first` block number, setting the appropriate bit of bitmap, then writing the data to disk. This function also handles cases when a file/folder's data exceed one block, in which case, after writing every block, the next free block is found and written to after filling all the appropriate `next` fields and such.
+Like readBlock, but always reads from the disk file, bypassing the block cache.
+*/
+int rawReadBlock(uint64_t blocknr, void *block);
+
+/*
+Like writeBlock, but always writes to the disk file, bypassing the block cache.
+*/
+int rawWriteBlock(uint64_t blocknr, void *block);
+
+/*
+Read `count` consecutive blocks starting at `blocknr`, block `blocknr + i` going into `blocks[i]`. Without the block cache this is a single vectored read.
+Returns the number of blocks read, or a negative error.
+*/
+int readBlocks(uint64_t blocknr, uint64_t count, void **blocks);
+
+/*
+Write `count` consecutive blocks starting at `blocknr`, block `blocknr + i` coming from `blocks[i]`. Without the block cache this is a single vectored write.
+Returns the number of blocks written, or a negative error.
+*/
+int writeBlocks(uint64_t blocknr, uint64_t count, void **blocks);
+
+/*
+Like readBlocks and writeBlocks, but always go to the disk file, bypassing the block cache.
+*/
+int rawReadBlocks(uint64_t blocknr, uint64_t count, void **blocks);
+int rawWriteBlocks(uint64_t blocknr, uint64_t count, void **blocks);
+
+/*
+Read or write several runs of consecutive blocks as one batch, bypassing the block cache. When FFS is built with `FFS_IO_URING` every run is queued on this thread's io_uring and the whole batch is submitted together, otherwise, or if io_uring can't be set up, each run is one preadv/pwritev.
+Returns 0 if successful, else a negative error.
+*/
+int rawReadRuns(block_run *runs, uint64_t nruns);
+int rawWriteRuns(block_run *runs, uint64_t nruns);
+
+/*
+Write several runs of consecutive blocks, through the block cache when it is enabled, else as one `rawWriteRuns` batch.
+Returns 0 if successful, else a negative error.
+*/
+int writeRuns(block_run *runs, uint64_t nruns);
+
+/*
+Map the whole disk file into memory for the mmap backend. From then on every block and byte range inside the mapping is read or written with a memory copy instead of a syscall, and the host page cache is the only copy of the data. Changes reach the disk file when the kernel writes the pages back, or at `syncDisk`.
+Returns 0 if successful, else a negative error.
+*/
+int mapDisk();
+
+/*
+Return the address of the `len` bytes at `offset` of the disk file in the mapping, or NULL if the disk is not mapped or the range lies outside the mapping.
+*/
+void *diskAddress(uint64_t offset, uint64_t len);
+
+/*
+msync the mapped disk file. With `wait` set, returns only once everything is on disk (MS_SYNC), else only schedules the write back (MS_ASYNC). Does nothing without the mmap backend.
+Returns 0 if successful, else a negative error.
+*/
+int syncDisk(int wait);
+
+/*
+Make everything written to the disk file so far durable : msync with the mmap backend, then fdatasync. Blocks still dirty in the block cache are not included.
+Returns 0 if successful, else a negative error.
+*/
+int flushDisk();
+
+/*
+Read or write `len` bytes at byte `offset` of the disk file, for data that is not laid out in whole blocks such as the superblock fields and the bitmap.
+All disk I/O is positional (pread/pwrite) so threads never share a file offset.
+Returns the number of bytes transferred, or a negative error.
+*/
+int64_t readDisk(void *buf, uint64_t len, uint64_t offset);
+int64_t writeDisk(void *buf, uint64_t len, uint64_t offset);
+
+/*
+Write `node` to disk. For files only the dirty blocks are written, mapping a block for any that is new. A file of at most TAIL_MAX bytes is instead stored as a fragment of a tail block shared with other small files, and moves to a block of its own once it grows past that. For directories whose children are in memory the entries are rewritten, mapping new blocks or releasing surplus ones as the directory grew or shrank.
+The inode record is then written with `writeInode` and any extent overflow blocks after it, for files only if `meta_dirty` says the metadata or extent map changed. These and the directory blocks are metadata and go through `journalWrite`.
+The inode must already be reserved with `allocInode` by the caller.
+Finally the bitmap blocks changed since the last save are written, so every operation ending in `diskWriter` persists its allocations once.
+Returns the number of blocks written, or a negative error if the inode could not be written, in which case `meta_dirty` stays set.
+*/
+int64_t diskWriter(fs_tree_node *node);
+
+/*
+Essentially a wrapper for reading inode `inode_no` from disk and reconstructing the node using appropriate functions. The reconstructed node is returned. Extents that overflowed the inode record are read too.
+NOTE : This function does not read file contents, i.e data, to the FS node, nor the entries of a directory.
+If the inode can't be read or there is no memory, the negative error is returned cast to a pointer, like `reconstructNode` does.
+*/
+fs_tree_node *diskReader(uint64_t inode_no);
+
+/*
+Read the entries of directory `dir`, up to `dir->len` of them, into `entries`.
+Returns the number of entries read, else a negative error.
+*/
+int64_t readEntries(fs_tree_node *dir, dir_entry *entries);
+
+/*
+Read `size` bytes of the payload of `node` starting at byte `offset` into `dest`. Only the blocks covering the range are read, whole blocks go straight into `dest`. Dirty blocks are read from memory and unmapped blocks read as zeroes.
+Returns the number of bytes read, or a negative error if a block can't be read or there is no memory.
 */
-uint64_t diskWriter(void *blocks_data, uint64_t blocks, uint64_t first);
+int64_t dataRangeReader(fs_tree_node *node, void *dest, uint64_t offset, uint64_t size);
 
 /*
-Essentially a wrapper for reading a block of data from disk and reconstructing the node using appropriate functions. The reconstructed node is returned. This function also handles cases when the block is found to have a `next` field with more data to be read.
-NOTE : This function does not read file contents, i.e data, to the FS node.
+Copy `size` bytes from `src` into the data of `node` at byte `offset`. Only the blocks covering the range are touched, they are kept as dirty blocks until the next `diskWriter`. Grows `data_size` if the range ends past it.
+Returns the number of bytes copied.
 */
-fs_tree_node *diskReader(uint64_t block);
+uint64_t dataRangeWriter(fs_tree_node *node, const void *src, uint64_t offset, uint64_t size);
 
 /*
-This function reads the DATA into the FS tree node at `node` handling cases where data may be spread across several blocks.
+Change the size of the data of `node` to `size`. Shrinking releases the blocks past the new end and zeroes the rest of the new last block, growing leaves a hole that reads as zeroes.
+Returns 0 if successful, else -ENOMEM.
 */
-uint64_t dataDiskReader(fs_tree_node *node);
+int truncateData(fs_tree_node *node, uint64_t size);
 
 
 #endif
\ No newline at end of file
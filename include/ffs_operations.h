@@ -18,6 +18,8 @@
 #include "bitmap.h"
 #include "tree.h"
 #include "disk.h"
+#include "cache.h"
+#include "journal.h"
 
 /*
 Get attributes function. Used to get attributes of a file/folder, i.e, FS tree node and "convert" them to the stat structure understood by Linux.
@@ -43,6 +45,7 @@ int ffs_mkdir(const char *path, mode_t m);
 /*
 READDIR function. Used to read contents of a directory.
 This function reads contents of the directory at `path` and places the same into the buffer `buf` using the filler function `filler` from offset `offset`. The `filler` function and `buffer` are taken care of by FUSE. Commonly used by running `ls` on bash shell.
+Every entry is passed with the offset of the one after it, and listing stops once `filler` reports the buffer full, so large directories are listed a buffer at a time. Entries whose node is in memory come with their attributes, others with their type only.
 Returns 0 if successful, else returns the appropriate error as defined in `errno.h`.
 */
 int ffs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
@@ -76,7 +79,7 @@ int ffs_read(const char *path, char *buf, size_t size, off_t offset,struct fuse_
 
 /*
 WRITE function. Used to write contents to a file.
-This function finds the FS tree node at `path` and places the contents of `buf` into it. Commonly used by programs when `write` system call is used.
+This function finds the FS tree node at `path` and places the contents of `buf` into it. The data is only buffered in memory, it is written on flush, release or fsync, or by the next commit. Commonly used by programs when `write` system call is used.
 Returns 0 if successful, else returns the appropriate error as defined in `errno.h`.
 */
 int ffs_write(const char *path, const char *buf, size_t size, off_t offset,struct fuse_file_info *fi);
@@ -123,4 +126,36 @@ Returns 0 if successful, else returns the appropriate error as defined in `errno
 */
 int ffs_flush(const  char *path, struct fuse_file_info *fi);
 
+/*
+RELEASE function. Called once the last file descriptor of an open file is closed.
+This function writes the contents of the file like `ffs_flush`. They become durable with the next commit, or earlier on `fsync`.
+Returns 0 if successful, else returns the appropriate error as defined in `errno.h`.
+*/
+int ffs_release(const char *path, struct fuse_file_info *fi);
+
+/*
+FSYNC function. Used to make the contents of a file durable. Commonly used by programs when `fsync` or `fdatasync` system call is used.
+This function writes the file like `ffs_flush`, then commits the journal and flushes the disk. Concurrent calls are coalesced into one commit. `datasync` is ignored, metadata is written either way.
+Returns 0 if successful, else returns the appropriate error as defined in `errno.h`.
+*/
+int ffs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+
+/*
+FSYNCDIR function. Same as `ffs_fsync` for a directory, makes the directory's entries durable.
+Returns 0 if successful, else returns the appropriate error as defined in `errno.h`.
+*/
+int ffs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi);
+
+/*
+INIT function. Called by FUSE once the file system is mounted and running in the background.
+This function starts the thread that writes back and commits changes every `commit_interval` seconds.
+*/
+void *ffs_init(void);
+
+/*
+DESTROY function. Called by FUSE once the file system is unmounted.
+This function writes every node still dirty in memory, commits and empties the journal, writes every block still dirty in the block cache to disk and frees the cache, waits for the mapped disk file to reach the disk with the mmap backend, then empties the dentry cache.
+*/
+void ffs_destroy(void *private_data);
+
 #endif
@@ -0,0 +1,135 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+/*
+    Write-ahead journal for metadata : inode blocks, extent overflow blocks, directory blocks and the bitmap.
+    Metadata written by operations is gathered in a running transaction instead of going to disk. A background thread commits the running transaction every `commit_interval` seconds, or sooner once it grows large, so the metadata of many operations reaches the disk as one sequential write to the journal region. Before each commit it writes back file data still held in memory, so every change is durable within the interval even if nothing calls fsync.
+    A commit first writes back the block cache, so every data block and every earlier transaction is on disk, then writes the transaction to the journal and only after that to the blocks' real places through the block cache. Those are written back lazily, the space of the journal is reclaimed only when a commit needs it.
+    The journal region is created by mkfs and recorded in the superblock. Disks without one, and the mmap backend, write metadata in place as before.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "disk.h"
+
+#define JOURNAL_SB_START (16)           // superblock offset of the first block of the journal region
+#define JOURNAL_SB_BLOCKS (24)          // superblock offset of the number of blocks in the journal region
+#define JOURNAL_FRACTION (16)           // mkfs gives the journal 1/16 of the disk
+#define JOURNAL_MIN_BLOCKS (16)
+#define JOURNAL_MAX_BLOCKS (8192)       // 32 MB
+#define JOURNAL_COMMIT_SECONDS (5)      // default commit interval
+
+#define JOURNAL_MAGIC (0x4646534A524E4CULL)     // "FFSJRNL"
+#define JOURNAL_HEADER (1)              // block types in the journal region
+#define JOURNAL_DESCRIPTOR (2)
+#define JOURNAL_COMMIT (3)
+#define JOURNAL_CLEAN (4)               // header type after a clean unmount
+#define JOURNAL_TAGS ((BLOCK_SIZE - 32) / 8)    // block numbers listed by one descriptor block
+
+/*
+First block of a journal record. The header is the first block of the region and says where replay starts, the tail. Its type is JOURNAL_HEADER while mounted and JOURNAL_CLEAN after a clean unmount.
+A transaction is a descriptor block listing the home block numbers of the blocks that follow it, repeated as needed, and a commit block holding a checksum of everything before it.
+*/
+typedef struct journal_block {
+    uint64_t magic;                     // JOURNAL_MAGIC
+    uint64_t type;                      // JOURNAL_HEADER, JOURNAL_DESCRIPTOR or JOURNAL_COMMIT
+    uint64_t seq;                       // transaction, for the header the first one to replay
+    uint64_t value;                     // header : tail block in the region, descriptor : number of tags, commit : checksum
+}journal_block;
+
+typedef struct journal_entry {
+    uint64_t blocknr;                   // real place of the block
+    uint8_t *data;                      // BLOCK_SIZE bytes
+}journal_entry;
+
+/*
+Metadata blocks written by the operations of one transaction, in the order they were first written, and the blocks those operations released.
+*/
+typedef struct transaction {
+    journal_entry *entries;
+    uint64_t count, cap;
+    int64_t *index;                     // open addressing hash table of entries keyed by block number, -1 for empty slots
+    uint64_t index_size;                // slots in index, a power of 2
+    uint64_t *freed;                    // blocks to release once no replayable transaction mentions them
+    uint64_t freed_count, freed_cap;
+}transaction;
+
+extern uint64_t commit_interval;        // longest time in seconds a change waits in memory before it is made durable
+
+/*
+Number of blocks mkfs reserves for the journal on a disk of `nblocks` blocks.
+*/
+uint64_t journalSize(uint64_t nblocks);
+
+/*
+Find the journal region from the superblock and replay every transaction that was committed but may not have reached its real place, so the metadata on disk is consistent again. Transactions are checked against their commit checksum, a torn one ends the replay.
+Journaling is then turned on unless `replay_only` is set, as for the mmap backend.
+Must be called after the disk, cache and backends are set up and before `load_fs`.
+Returns 0 if successful, 1 if the file system was not unmounted cleanly, in which case blocks freed just before the stop may still be marked used and `rebuild_bitmap` should be run after `load_fs`. Else a negative error.
+*/
+int openJournal(int replay_only);
+
+/*
+Returns 1 if metadata is being journaled, else 0.
+*/
+int journalEnabled();
+
+/*
+Add metadata block `blocknr` with contents `block` to the running transaction, replacing any earlier contents of it in there. The block is copied.
+Without the journal the block is written with `writeBlock`.
+A block is never written in place while journaling. If there is no memory to add it, -ENOMEM is returned, and from then on metadata writes and commits fail with EIO, since the running transaction no longer holds whole operations.
+Returns BLOCK_SIZE if successful, else a negative error.
+*/
+int journalWrite(uint64_t blocknr, void *block);
+
+/*
+If block `blocknr` has contents in a transaction not yet written to its real place, copy them into `block` and return 1, else return 0.
+`journalPending` checks whether any of `count` blocks from `blocknr` has such contents.
+*/
+int journalRead(uint64_t blocknr, void *block);
+int journalPending(uint64_t blocknr, uint64_t count);
+
+/*
+Release block `blocknr`. While journaling, its bit is cleared once the transaction freeing it is committed, so the old contents stay intact until the change replacing them is durable. A block that a committed transaction still in the journal wrote as metadata waits longer, until the tail moves past it, so it can't be handed out and overwritten while a replay would still write old metadata over it.
+*/
+void journalFree(uint64_t blocknr);
+
+/*
+Start the background thread committing every `commit_interval` seconds. Also runs without the journal, then it only writes back and flushes. Called once FUSE has forked into the background.
+*/
+void journalStart();
+
+/*
+Commit the running transaction now and wait for it to be on disk, along with every block written to the block cache before the call. Without the journal only the cache is written back and the disk flushed.
+Takes `tree_lock` for writing to find a point between operations, so it must not be called while holding it or any node lock.
+Returns 0 if successful, else a negative error.
+*/
+int journalCommit();
+
+/*
+Make everything written before the call durable, as for fsync. Callers arriving while a commit is being written wait for it and start one more commit between them, not one each.
+Same locking rules as `journalCommit`.
+Returns 0 if successful, else a negative error.
+*/
+int journalSync();
+
+/*
+Commit on the calling thread if the running transaction takes more than 3/4 of the journal, so that it can't outgrow the journal while the background commit catches up. Called by operations that write metadata, before they take `tree_lock`.
+*/
+void journalThrottle();
+
+/*
+Release blocks freed by committed transactions, writing everything back and moving the tail of the journal if needed. Used when the disk looks full. Safe to call while holding `tree_lock`.
+Returns the number of blocks released.
+*/
+uint64_t journalReclaim();
+
+/*
+Stop the background thread. Then commit, write everything back and empty the journal, turn journaling off and mark the journal clean. Used at unmount, before `destroyCache`.
+*/
+void closeJournal();
+
+#endif
@@ -12,19 +12,43 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "disk.h"
 #include "bitmap.h"
+#include "dcache.h"
 
 #define DEF_DIR_PERM (0775)
 #define DEF_FILE_PERM (0664)
 
-// fields = type + name + len + uid + gid + perms + nlinks + data_size + atim + mtim + ctim < + data + > + inode_no + next_block
-// in bits = 8 + (256*8) + 32 + 32 + 32 + 32 + 8 + 64 + (16*8) + (16*8) + (16*8) + 64 + 64 = 2768 = 346 bytes
-#define NODE_SIZE (346)
+// fields = type + name + len + uid + gid + perms + nlinks + data_size + atim + mtim + ctim + inode_no + extent_count + ext_next
+// in bits = 8 + (256*8) + 32 + 32 + 32 + 32 + 8 + 64 + (16*8) + (16*8) + (16*8) + 64 + 32 + 64 = 2800 = 350 bytes
+#define NODE_SIZE (350)
 
 #define SUPERBLOCKS 1   // number of blocks designated to be part of superblock
 
+#define CHILD_INDEX_MIN 8       // directories with fewer children are searched linearly, without an index
+#define DEFAULT_NODE_BUDGET (262144)    // nodes kept in memory before unused directories are evicted, unless told otherwise at mount
+#define SCAN_CHUNK (64)                 // children of one directory read by a scan worker in one go
+
+
+/*
+A contiguous run of disk blocks holding part of a node's payload (file data or child inode numbers).
+File block `logical` is stored at disk block `start`, `logical + 1` at `start + 1` and so on for `length` blocks.
+*/
+typedef struct extent {
+    uint64_t logical;                   // first file block covered by this extent
+    uint64_t start;                     // first disk block of this extent
+    uint64_t length;                    // number of blocks in this extent
+}extent;
+
+/*
+New contents of one file block, kept in memory until the node is written to disk.
+*/
+typedef struct dirty_block {
+    uint64_t fblock;                    // file block this buffer belongs to
+    uint8_t *buf;                       // BLOCK_SIZE bytes
+}dirty_block;
 
 typedef struct fs_tree_node {
     uint8_t type;                       //type of node
@@ -39,11 +63,27 @@ typedef struct fs_tree_node {
     struct fs_tree_node **children;      //links to children
     uint32_t len;                       //number of children
     uint64_t *ch_inodes;            // inode_no of children
-
-    uint8_t *data;						//data for read and write
+    struct fs_tree_node **child_index;  // open addressing hash table of children keyed by name, NULL for small directories
+    uint32_t index_size;                // slots in child_index, a power of 2
+    uint32_t index_used;                // slots holding a child or a deleted marker
+    uint8_t loaded;                     // directory's children are in memory, else only ch_inodes is
+    uint8_t stub;                       // only name, type and inode_no are known, from the parent's directory entry
+    uint64_t last_used;                 // tick of the last lookup in this directory, for eviction
+    pthread_rwlock_t lock;              // guards data, extents and attributes, and loading the children of a directory
+
+    dirty_block *dirty;                 // modified file blocks not yet on disk, sorted by file block
+    uint32_t dirty_count;               // number of dirty blocks
+    uint32_t dirty_cap;                 // slots allocated in dirty
+    uint8_t meta_dirty;                 // set when metadata or the extent map changed since the inode record was written
     uint64_t data_size;						//size of data
-    uint64_t block_count;               // number of blocks
-    uint64_t inode_no;                  // the inode number, i.e, the block containing first part of data
+    uint64_t block_count;               // number of data blocks mapped by extents
+    uint64_t inode_no;                  // the inode number, record inode_no % inodes_per_block of table block inode_no / inodes_per_block holds the metadata and extent map
+
+    extent *extents;                    // block map of the payload, sorted by logical block
+    uint32_t extent_count;              // number of extents
+    uint64_t *ext_blocks;               // overflow blocks holding extents that do not fit in the inode record
+    uint32_t ext_block_count;           // number of overflow blocks
+    uint64_t tail;                      // fragment holding the data of a small file, 0 if it has none
 
     struct timespec st_atim;            /* time of last access */
     struct timespec st_mtim;            /* time of last modification */
@@ -58,6 +98,17 @@ types:
 
 extern int diskfd;
 
+extern uint64_t node_budget;        // nodes to keep in memory, 0 for no limit
+extern uint64_t tree_nodes;         // nodes currently in memory
+
+/*
+Namespace lock. Held for reading by every operation while it uses nodes, and for writing by operations that change the shape of the tree: adding, removing and renaming nodes, and evicting directories. Holding it for reading guarantees no node is freed or moved, and that the children of loaded directories don't change.
+Data and attributes of a node are guarded by its own `lock` : read for getattr, read and the like, write for write, truncate, chmod and the like, so operations on different files run in parallel and reads of one file too.
+Lock order is `tree_lock`, then at most one node `lock`, then the lower level locks in this order : the inode table or tail table lock (never both), the journal's commit lock, the allocator lock, the journal lock and the block cache lock. Each of these may be taken while holding any that come before it. For example, saveBitMap journals the bitmap under the allocator lock, and allocating a table block may reclaim journal space under a table lock. The allocator drops its lock before reclaiming, and the journal drops its own before clearing bits. The dentry cache and O_DIRECT pool locks come last and are never held while taking another.
+Rename takes `tree_lock` for writing, which already excludes every other operation, so it takes no node locks and the order of its source and destination never matters.
+*/
+extern pthread_rwlock_t tree_lock;
+
 /*
 Free all dynamically allocated members of node and free node itself too.
 Return 0 if all okay, else return -1.
@@ -84,14 +135,32 @@ Uses Breadth-First-Search to recursively apply the function (foo) to each node u
 */
 int bfs_dispatch(fs_tree_node *curr, int (*foo)(fs_tree_node *));
 
+/*
+Returns the child of directory `dir` whose name is the `len` characters at `name`, which need not be NUL terminated. NULL if there is none. Uses the hash index of `dir` if it has one.
+The child is read from its inode with `load_node` if it is still a stub.
+*/
+fs_tree_node *find_child(fs_tree_node *dir, const char *name, size_t len);
+
+/*
+Add `child` to the hash index of directory `dir`, which must already list it in `children`. The index is created once `dir` reaches `CHILD_INDEX_MIN` children and grown as needed.
+Returns 0, or -ENOMEM.
+*/
+int index_child(fs_tree_node *dir, fs_tree_node *child);
+
+/*
+Remove `child` from the hash index of directory `dir`. `child->name` must still be the name it was indexed under.
+*/
+void unindex_child(fs_tree_node *dir, fs_tree_node *child);
+
 /*
 Returns address of node if node exists in FS tree, else 0.
+The path is walked in place, no memory is allocated apart from the dentry cache entry recorded for it.
 */
 fs_tree_node *node_exists(const char *path);
 
 /*
 Create a file at `path` of type specified by `mode`. If any intermediate directory in `path` doesn't exist, error is thrown automatically.
-Returns address of added node in FS tree.
+Returns address of added node in FS tree. If the node or its parent can't be written, the node is taken out again and the negative error is returned cast to a pointer.
 */
 fs_tree_node *add_fs_tree_node(const char *path, uint8_t type);
 
@@ -102,7 +171,7 @@ If any intermediate directory in `path` doesn't exist, error is thrown.
 int remove_fs_tree_node(const char *path);
 
 /*
-Copies all members from `from` to `to`, except link to parent, name and fullname.
+Copies all members from `from` to `to`, except link to parent, name and fullname. Children of a directory are re-parented to `to`.
 Assumes both nodes already exist and are allocated space, but pointer members of `to` are not allocated.
 Does not free anything, strictly copies and returns.
 Returns 0.
@@ -111,13 +180,51 @@ int copy_nodes(fs_tree_node *from, fs_tree_node *to);
 
 /*
 Load an already initialised FS from a file/persistent storage opened using `openDisk`.
+Reads the number of inodes per table block from the superblock first, 1 for disks made before inodes were packed.
+Returns 0 if successful, else a negative error.
 */
 int load_fs(int diskfd);
 
 /*
-Rebuilds the FS tree with all the metadata of all files/folders stored in persistent storage accessed via `diskfd`.
+Read the children of directory `dir` from disk if they are not in memory yet. Directories are loaded this way on first lookup or listing, so mounting only reads the root.
+Only the directory's own blocks are read, each child is a stub holding the name, type and inode number from its entry until `load_node` reads its inode. Children of directories written before entries had names are read from their inodes right away.
+Loading takes the write lock of `dir`, so it is safe with `tree_lock` only held for reading, but the caller must not hold the lock of `dir` itself.
+Returns 0, or -ENOMEM.
+*/
+int load_children(fs_tree_node *dir);
+
+/*
+Read the inode of `node` if it is a stub. Takes the write lock of `node` like `load_children`, with the same rules.
+Returns 0, or a negative error.
+*/
+int load_node(fs_tree_node *node);
+
+/*
+Read the whole FS tree into memory using `threads` worker threads. Workers take chunks of up to `SCAN_CHUNK` children of a directory at a time, so the siblings in a large directory are read in parallel too, and queue the subdirectories they find.
+Meant to be called right after `load_fs`, before any other thread touches the tree.
+Returns 0, or -ENOMEM.
+*/
+int scan_fs_tree(int threads);
+
+/*
+Evict directories while more than `node_budget` nodes are in memory, least recently used first, until a quarter of the budget is free again. Only directories whose loaded children are all clean files or unloaded directories are evicted, they go back to holding just `ch_inodes`. The dentry cache is emptied when anything is evicted.
+Takes `tree_lock` for writing when there is anything to evict, so it must be called only when no node pointers or locks are held, i.e, at the start of an operation.
+*/
+void trim_fs_tree();
+
+/*
+Write every node in memory that has changes not yet given to `diskWriter`, i.e, buffered file blocks or changed metadata. Directories that aren't loaded are skipped, nothing below them can be dirty.
+Takes `tree_lock` for reading and each node's lock in turn, so it must be called without holding any.
+Nodes that can't be written stay dirty. Returns 0 if every node was written, else the first error.
+*/
+int sync_fs_tree();
+
+/*
+Recompute the bitmap from the blocks actually in use : the superblock, the bitmap, the journal region and every inode, extent overflow block and extent reachable from the root. Blocks marked used that nothing points at are released, blocks in use but marked free are marked. Reads one inode at a time, nothing is kept in memory.
+Run at mount after `load_fs`, when `openJournal` says the file system was not unmounted cleanly, before any other thread touches the tree.
+Returns the number of blocks released, or -ENOMEM.
 */
-void fill_fs_tree(fs_tree_node *root);
+int rebuild_bitmap();
 
 
 #endif
\ No newline at end of file
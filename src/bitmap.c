@@ -1,4 +1,27 @@
 #include "bitmap.h"
+#include "journal.h"
+
+#include <string.h>
+#include <endian.h>
+#include <pthread.h>
+
+uint64_t bmap_size;
+uint8_t *bitmap;
+
+// Summary level, bit w is set when word w of the bitmap is fully used
+static uint64_t *summary = NULL;
+static uint64_t summary_words = 0;
+static uint8_t *summary_bitmap = NULL;     // bitmap the summary was built from
+
+// One flag per 4 KB block of the bitmap, set when the block changed since the last save
+static uint8_t *dirty_blocks = NULL;
+static uint64_t dirty_count = 0;
+
+// Next-fit cursor, word where the last search found free space
+static uint64_t cursor = 0;
+
+// Allocator lock, protects the bitmap, the summary, the dirty flags and the cursor
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
 
 // Error logging for THIS MODULE, helps differentiate from logging of other modules
 // Prints errors and logging info to STDOUT
@@ -17,11 +40,105 @@ static void error_log(char *fmt, ...) {
 }
 
 
+// Number of 64 bit words covering the bitmap, the last one may be partial
+static uint64_t wordCount() {
+    return (bmap_size + 7) / 8;
+}
+
+// Load word `w` of the bitmap, bit b of the word is block w * 64 + b.
+// Bits past the end of the bitmap read as used.
+static uint64_t loadWord(uint64_t w) {
+    uint64_t word = ~0ULL;
+    uint64_t bytes = bmap_size - w * 8;
+
+    if(bytes > 8)
+        bytes = 8;
+    memcpy(&word, bitmap + w * 8, bytes);
+    return le64toh(word);
+}
+
+// Number of disk blocks holding the bitmap
+static uint64_t mapBlockCount() {
+    return (bmap_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+// Rebuild the summary level from the bitmap and reset the dirty block flags
+static void buildSummary() {
+    uint64_t w, words = wordCount();
+
+    free(summary);
+    free(dirty_blocks);
+    summary_words = (words + 63) / 64;
+    summary = (uint64_t *)calloc(summary_words ? summary_words : 1, sizeof(uint64_t));
+    dirty_blocks = (uint8_t *)calloc(mapBlockCount() + 1, sizeof(uint8_t));
+    if(!summary || !dirty_blocks) {
+        perror("buildSummary problem");
+        exit(0);
+    }
+    dirty_count = 0;
+
+    for(w = 0; w < words; w++) {
+        if(loadWord(w) == ~0ULL)
+            summary[w / 64] |= 1ULL << (w % 64);
+    }
+    summary_bitmap = bitmap;
+    cursor = 0;
+}
+
+// The summary is built lazily so that callers filling `bitmap` directly (mkfs) also get one
+static void checkSummary() {
+    if(!summary || summary_bitmap != bitmap)
+        buildSummary();
+}
+
+// Keep the summary bit of the word holding `bitno` in step with the bitmap,
+// and remember that its bitmap block has to be written out
+static void updateSummary(uint64_t bitno) {
+    uint64_t w = bitno / 64;
+    uint64_t b = bitno / 8 / BLOCK_SIZE;
+
+    if(!dirty_blocks[b]) {
+        dirty_blocks[b] = 1;
+        dirty_count++;
+    }
+
+    if(loadWord(w) == ~0ULL)
+        summary[w / 64] |= 1ULL << (w % 64);
+    else
+        summary[w / 64] &= ~(1ULL << (w % 64));
+}
+
+// Set bit `bitno` to `value`. Called with the allocator lock held.
+static void setBit(uint64_t bitno, int value) {
+    if(value)
+        bitmap[bitno / 8] |= 1 << (bitno % 8);
+    else
+        bitmap[bitno / 8] &= ~(1 << (bitno % 8));
+    updateSummary(bitno);
+}
+
+// Find a word with a free bit among words [from, to), using the summary to skip full ones
+static int64_t findFreeWord(uint64_t from, uint64_t to) {
+    uint64_t s, free_words;
+
+    for(s = from / 64; s * 64 < to; s++) {
+        free_words = ~summary[s];
+        if(s == from / 64)
+            free_words &= ~0ULL << (from % 64);
+        if(!free_words)
+            continue;
+
+        uint64_t w = s * 64 + __builtin_ctzll(free_words);
+        return w < to ? (int64_t)w : -1;
+    }
+    return -1;
+}
+
+
 int loadBitMap(int fd) {
     error_log("%s called with fd = %d", __func__, fd);
 
-    lseek(fd, 8, SEEK_SET);
-    int ret = read(fd, &bmap_size, 8);
+    int ret = pread(fd, &bmap_size, 8, 8);
     error_log("bmap size = %lu bytes", bmap_size);
 
     if(ret < 0) {
@@ -30,14 +147,22 @@ int loadBitMap(int fd) {
         exit(0);
     }
 
+    // with the mmap backend the bitmap is used in place, changes go straight to the mapped disk file
+    bitmap = diskAddress(SUPERBLOCKS * BLOCK_SIZE, bmap_size);
+    if(bitmap) {
+        buildSummary();
+        error_log("Bitmap mapped at %p", bitmap);
+        return bmap_size;
+    }
+
     // bmap_size is number of bytes taken by bitmap
     bitmap = (uint8_t *)malloc(bmap_size);
     if(!bitmap) {
         return -1;
     }
 
-    lseek(fd, SUPERBLOCKS * BLOCK_SIZE, SEEK_SET);
-    ret = read(fd, bitmap, bmap_size);
+    ret = pread(fd, bitmap, bmap_size, SUPERBLOCKS * BLOCK_SIZE);
+    buildSummary();
 
     error_log("Returning with %d", ret);
     return ret;
@@ -47,8 +172,62 @@ int loadBitMap(int fd) {
 void saveBitMap() {
     error_log("%s called", __func__);
 
-    lseek(diskfd, SUPERBLOCKS * BLOCK_SIZE, SEEK_SET);
-    write(diskfd, bitmap, bmap_size);
+    pthread_mutex_lock(&alloc_lock);
+    if(!dirty_blocks || !dirty_count) {
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    uint64_t b = 0, run, blocks = mapBlockCount();
+
+    if(bitmap == diskAddress(SUPERBLOCKS * BLOCK_SIZE, bmap_size)) {
+        // bitmap lives in the mapped disk file, already written
+        memset(dirty_blocks, 0, blocks);
+        dirty_count = 0;
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    if(journalEnabled()) {
+        // bitmap blocks are metadata, they go into the running transaction with the rest of the operation
+        uint8_t *buf = (uint8_t *)calloc(1, BLOCK_SIZE);
+        for(b = 0 ; b < blocks && buf ; b++) {
+            if(!dirty_blocks[b])
+                continue;
+            dirty_blocks[b] = 0;
+
+            uint64_t len = (b * BLOCK_SIZE + BLOCK_SIZE > bmap_size) ? bmap_size - b * BLOCK_SIZE : BLOCK_SIZE;
+            memset(buf, 0, BLOCK_SIZE);         // the last bitmap block is only partly used
+            memcpy(buf, bitmap + b * BLOCK_SIZE, len);
+            journalWrite(SUPERBLOCKS + b, buf);
+        }
+        free(buf);
+        if(buf)
+            dirty_count = 0;
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    // Write each run of consecutive dirty bitmap blocks with one call
+    while(b < blocks) {
+        if(!dirty_blocks[b]) {
+            b++;
+            continue;
+        }
+
+        for(run = b; run < blocks && dirty_blocks[run]; run++)
+            dirty_blocks[run] = 0;
+
+        uint64_t len = (run - b) * BLOCK_SIZE;
+        if(b * BLOCK_SIZE + len > bmap_size)
+            len = bmap_size - b * BLOCK_SIZE;
+
+        writeDisk(bitmap + b * BLOCK_SIZE, len, (SUPERBLOCKS + b) * BLOCK_SIZE);
+        error_log("Wrote bitmap blocks %lu to %lu", b, run - 1);
+        b = run;
+    }
+    dirty_count = 0;
+    pthread_mutex_unlock(&alloc_lock);
 
     error_log("%s done", __func__);
 }
@@ -57,48 +236,127 @@ void saveBitMap() {
 uint64_t findFirstFreeBlock() {
     error_log("%s called", __func__);
 
-    uint64_t index = 0;
-    int bit_index = 0;
-    int val, found = 0;
-
-    while(index < bmap_size) {
-        bit_index = 0;
-        while(bit_index < 8) {
-            val = (int)pow(2, bit_index);
-            
-            if( !(bitmap[index] & val) ) {
-                found = 1;
+    pthread_mutex_lock(&alloc_lock);
+    checkSummary();
+
+    uint64_t words = wordCount();
+    if(cursor >= words)
+        cursor = 0;
+
+    int64_t w = findFreeWord(cursor, words);
+    if(w < 0)
+        w = findFreeWord(0, cursor);
+
+    if(w < 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        error_log("Returning not found!");
+        return -1;
+    }
+
+    cursor = w;
+    uint64_t blocknr = w * 64 + __builtin_ctzll(~loadWord(w));
+    pthread_mutex_unlock(&alloc_lock);
+    error_log("Returning with %lu", blocknr);
+    return blocknr;
+}
+
+
+// First free bit in [bit, limit), or `limit` if there is none
+static uint64_t nextFreeBit(uint64_t bit, uint64_t limit) {
+    uint64_t w = bit / 64, ret;
+    uint64_t free_bits = ~loadWord(w) & (~0ULL << (bit % 64));
+
+    if(free_bits)
+        ret = w * 64 + __builtin_ctzll(free_bits);
+    else {
+        int64_t fw = findFreeWord(w + 1, wordCount());
+        if(fw < 0)
+            return limit;
+        ret = fw * 64 + __builtin_ctzll(~loadWord(fw));
+    }
+
+    return ret < limit ? ret : limit;
+}
+
+// First used bit in [bit, limit), or `limit` if there is none
+static uint64_t nextUsedBit(uint64_t bit, uint64_t limit) {
+    uint64_t w = bit / 64, ret;
+    uint64_t used_bits = loadWord(w) & (~0ULL << (bit % 64));
+
+    while(!used_bits && ++w * 64 < limit)
+        used_bits = loadWord(w);
+    if(!used_bits)
+        return limit;
+
+    ret = w * 64 + __builtin_ctzll(used_bits);
+    return ret < limit ? ret : limit;
+}
+
+
+uint64_t allocBlocks(uint64_t goal, uint64_t count, uint64_t *got) {
+    error_log("%s called for %lu blocks near %lu", __func__, count, goal);
+
+    pthread_mutex_lock(&alloc_lock);
+    checkSummary();
+
+    uint64_t bits = bmap_size * 8;
+    if(!goal || goal >= bits)
+        goal = (cursor * 64 < bits) ? cursor * 64 : 0;
+
+    uint64_t pos = goal, end = bits, start, stop, len;
+    uint64_t best_start = 0, best_len = 0;
+    int runs, wrapped = 0;
+
+    // take the first free run from `goal` onwards that is long enough, else the longest one seen
+    for(runs = 0 ; runs < ALLOC_SCAN_RUNS && best_len < count ; ) {
+        start = nextFreeBit(pos, end);
+        if(start >= end) {
+            if(wrapped || !goal)
                 break;
-            }
-            bit_index++;
+            wrapped = 1;
+            pos = 0;
+            end = goal;
+            continue;
+        }
+
+        stop = nextUsedBit(start, (bits - start > count) ? start + count : bits);
+        len = stop - start;
+        if(len > best_len) {
+            best_start = start;
+            best_len = len;
         }
 
-        if(!found)
-            index++;
-        else
-            break;
+        pos = stop;
+        runs++;
     }
 
-    if(found) {
-        error_log("Returning with %lu", index * 8 + bit_index);
-        return (index * 8 + bit_index);
+    *got = best_len;
+    if(!best_len) {
+        pthread_mutex_unlock(&alloc_lock);
+        // blocks freed by committed transactions may be waiting for the journal, release them and look again
+        if(journalReclaim())
+            return allocBlocks(goal, count, got);
+        error_log("Returning not found!");
+        return -1;
     }
-    
-    error_log("Returning not found!");
-    return -1;
+
+    for(len = 0 ; len < best_len ; len++)
+        setBit(best_start + len, 1);
+    cursor = (best_start + best_len - 1) / 64;
+    pthread_mutex_unlock(&alloc_lock);
+
+    error_log("Returning with %lu, %lu blocks", best_start, best_len);
+    return best_start;
 }
 
 
 int setBitofMap(uint64_t bitno) {
     error_log("%s called on bitno %llu", __func__, bitno);
     
-    uint64_t index = bitno / 8;
-    int bit_index = bitno % 8;
-
-    int val = (int)pow(2, bit_index);
-    bitmap[index] = bitmap[index] | (val);
-
-    saveBitMap();
+    pthread_mutex_lock(&alloc_lock);
+    checkSummary();
+    setBit(bitno, 1);
+    pthread_mutex_unlock(&alloc_lock);
     return 0;
 }
 
@@ -106,14 +364,19 @@ int setBitofMap(uint64_t bitno) {
 int clearBitofMap(uint64_t bitno) {
     error_log("%s called on bitno %llu", __func__, bitno);
 
-    uint64_t index = bitno / 8;
-    int bit_index = bitno % 8;
+    pthread_mutex_lock(&alloc_lock);
+    checkSummary();
+    setBit(bitno, 0);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
 
-    int val = (int)pow(2, bit_index);
-    bitmap[index] = bitmap[index] & ~(val);
 
-    saveBitMap();
-    return 0;
+int testBitofMap(uint64_t bitno) {
+    pthread_mutex_lock(&alloc_lock);
+    int ret = !!(bitmap[bitno / 8] & (1 << (bitno % 8)));
+    pthread_mutex_unlock(&alloc_lock);
+    return ret;
 }
 
 void print_bitmap() {
@@ -0,0 +1,350 @@
+#include "cache.h"
+
+uint64_t cache_hits, cache_misses, cache_writebacks;
+
+static cache_entry *slots = NULL;       // all cache slots
+static uint8_t *pool = NULL;            // block data of all slots, one allocation
+static uint64_t slot_count = 0;
+static int64_t *buckets = NULL;         // hash buckets, index of first slot in chain or -1
+static uint64_t bucket_mask = 0;
+static uint64_t hand = 0;               // CLOCK hand
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;     // protects everything above and the slot headers
+static pthread_cond_t io_done = PTHREAD_COND_INITIALIZER;          // broadcast whenever a slot stops being busy
+
+// Error logging for THIS MODULE, helps differentiate from logging of other modules
+// Prints errors and logging info to STDOUT
+// Passes format strings and args to vprintf, basically a wrapper for printf
+static void error_log(char *fmt, ...) {
+#ifdef ERR_FLAG
+    va_list args;
+    va_start(args, fmt);
+    
+    printf("CACHE : ");
+    vprintf(fmt, args);
+    printf("\n");
+
+    va_end(args);
+#endif
+}
+
+
+static uint64_t bucketOf(uint64_t blocknr) {
+    return (blocknr * 0x9E3779B97F4A7C15ULL >> 17) & bucket_mask;
+}
+
+
+int initCache(uint64_t nblocks) {
+    error_log("%s called for %lu blocks", __func__, nblocks);
+
+    if(!nblocks)
+        return 0;
+
+    uint64_t nbuckets = 1;
+    while(nbuckets < nblocks)
+        nbuckets <<= 1;
+
+    slots = (cache_entry *)calloc(nblocks, sizeof(cache_entry));
+    // block aligned, so slots can be read and written with O_DIRECT as they are
+    if(posix_memalign((void **)&pool, BLOCK_SIZE, nblocks * BLOCK_SIZE))
+        pool = NULL;
+    buckets = (int64_t *)malloc(nbuckets * sizeof(int64_t));
+    if(!slots || !pool || !buckets) {
+        error_log("NO MEMORY!");
+        free(slots);
+        free(pool);
+        free(buckets);
+        slots = NULL;
+        pool = NULL;
+        buckets = NULL;
+        return -ENOMEM;
+    }
+
+    uint64_t i;
+    for(i = 0 ; i < nblocks ; i++) {
+        slots[i].data = pool + (i * BLOCK_SIZE);
+        slots[i].next = -1;
+    }
+    for(i = 0 ; i < nbuckets ; i++)
+        buckets[i] = -1;
+
+    slot_count = nblocks;
+    bucket_mask = nbuckets - 1;
+    hand = 0;
+    cache_hits = cache_misses = cache_writebacks = 0;
+
+    error_log("Cache ready with %lu slots and %lu buckets", slot_count, nbuckets);
+    return 0;
+}
+
+
+int cacheEnabled() {
+    return slot_count != 0;
+}
+
+
+// Slot holding `blocknr`, or -1 if it isn't cached.
+static int64_t lookupSlot(uint64_t blocknr) {
+    int64_t i = buckets[bucketOf(blocknr)];
+    while(i != -1 && slots[i].blocknr != blocknr)
+        i = slots[i].next;
+
+    return i;
+}
+
+
+// Like lookupSlot, but waits for I/O on the slot to finish. Called with the cache lock held.
+static int64_t lookupIdleSlot(uint64_t blocknr) {
+    int64_t i;
+    while((i = lookupSlot(blocknr)) != -1 && slots[i].busy)
+        pthread_cond_wait(&io_done, &cache_lock);
+
+    return i;
+}
+
+
+static void linkSlot(int64_t slot, uint64_t blocknr) {
+    uint64_t b = bucketOf(blocknr);
+    slots[slot].blocknr = blocknr;
+    slots[slot].valid = 1;
+    slots[slot].dirty = 0;
+    slots[slot].referenced = 1;
+    slots[slot].next = buckets[b];
+    buckets[b] = slot;
+}
+
+
+static void unlinkSlot(int64_t slot) {
+    int64_t *link = &(buckets[bucketOf(slots[slot].blocknr)]);
+    while(*link != slot)
+        link = &(slots[*link].next);
+    *link = slots[slot].next;
+    slots[slot].next = -1;
+    slots[slot].valid = 0;
+}
+
+
+static void releaseSlot(int64_t slot) {
+    slots[slot].busy = 0;
+    pthread_cond_broadcast(&io_done);
+}
+
+
+// Pick a free slot with CLOCK, writing back and unlinking whatever it held. The slot is returned busy and unlinked.
+// Called with the cache lock held, which is dropped while a dirty victim is written back.
+static int64_t claimSlot() {
+    int64_t slot;
+    uint64_t scanned = 0;
+    int ret;
+
+    while(1) {
+        if(scanned > 2 * slot_count) {      // every slot is busy, wait for one to finish
+            pthread_cond_wait(&io_done, &cache_lock);
+            scanned = 0;
+        }
+
+        slot = hand;
+        hand = (hand + 1) % slot_count;
+        scanned++;
+
+        if(slots[slot].busy)
+            continue;
+
+        if(!slots[slot].valid)
+            break;
+
+        if(slots[slot].referenced) {        // second chance
+            slots[slot].referenced = 0;
+            continue;
+        }
+
+        if(slots[slot].dirty) {
+            slots[slot].busy = 1;
+            pthread_mutex_unlock(&cache_lock);
+            ret = rawWriteBlock(slots[slot].blocknr, slots[slot].data);
+            pthread_mutex_lock(&cache_lock);
+            releaseSlot(slot);
+
+            if(ret < 0) {
+                error_log("Write back of %lu failed with %d", slots[slot].blocknr, ret);
+                return ret;
+            }
+            slots[slot].dirty = 0;
+            cache_writebacks++;
+        }
+        unlinkSlot(slot);
+        break;
+    }
+
+    slots[slot].busy = 1;
+    return slot;
+}
+
+
+int cacheRead(uint64_t blocknr, void *block) {
+    error_log("%s called for block %lu", __func__, blocknr);
+
+    int64_t slot;
+    int ret;
+
+    pthread_mutex_lock(&cache_lock);
+    while(1) {
+        slot = lookupIdleSlot(blocknr);
+        if(slot != -1) {
+            cache_hits++;
+            slots[slot].referenced = 1;
+            memcpy(block, slots[slot].data, BLOCK_SIZE);
+            pthread_mutex_unlock(&cache_lock);
+            return BLOCK_SIZE;
+        }
+
+        slot = claimSlot();
+        if(slot < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return rawReadBlock(blocknr, block);
+        }
+
+        // the lock may have been dropped, another thread could have brought the block in meanwhile
+        if(lookupSlot(blocknr) == -1)
+            break;
+        releaseSlot(slot);
+    }
+
+    cache_misses++;
+    linkSlot(slot, blocknr);
+    pthread_mutex_unlock(&cache_lock);
+
+    ret = rawReadBlock(blocknr, slots[slot].data);
+
+    pthread_mutex_lock(&cache_lock);
+    releaseSlot(slot);
+    if(ret < 0)
+        unlinkSlot(slot);
+    else
+        memcpy(block, slots[slot].data, BLOCK_SIZE);
+    pthread_mutex_unlock(&cache_lock);
+
+    return ret < 0 ? ret : BLOCK_SIZE;
+}
+
+
+int cacheWrite(uint64_t blocknr, void *block) {
+    error_log("%s called for block %lu", __func__, blocknr);
+
+    int64_t slot;
+
+    pthread_mutex_lock(&cache_lock);
+    while((slot = lookupIdleSlot(blocknr)) == -1) {
+        slot = claimSlot();      // whole block is overwritten, no need to read it first
+        if(slot < 0) {
+            pthread_mutex_unlock(&cache_lock);
+            return rawWriteBlock(blocknr, block);
+        }
+
+        if(lookupSlot(blocknr) == -1) {
+            linkSlot(slot, blocknr);
+            releaseSlot(slot);
+            break;
+        }
+        releaseSlot(slot);
+    }
+
+    memcpy(slots[slot].data, block, BLOCK_SIZE);
+    slots[slot].dirty = 1;
+    slots[slot].referenced = 1;
+    pthread_mutex_unlock(&cache_lock);
+
+    return BLOCK_SIZE;
+}
+
+
+static int compareSlots(const void *a, const void *b) {
+    uint64_t x = slots[*(const int64_t *)a].blocknr, y = slots[*(const int64_t *)b].blocknr;
+    return (x > y) - (x < y);
+}
+
+
+int flushCache() {
+    error_log("%s called", __func__);
+
+    if(!slot_count)
+        return 0;
+
+    int64_t *order = (int64_t *)malloc(slot_count * sizeof(int64_t));
+    void **bufs = (void **)malloc(slot_count * sizeof(void *));
+    block_run *runs = (block_run *)malloc(slot_count * sizeof(block_run));
+    uint64_t i, j, n = 0, nruns = 0;
+    int ret;
+
+    if(!order || !bufs || !runs) {
+        error_log("No memory to flush");
+        free(order);
+        free(bufs);
+        free(runs);
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    for(i = 0 ; i < slot_count ; i++) {
+        if(slots[i].valid && slots[i].dirty && slots[i].busy) {
+            // already being written back by an eviction, wait for it and start over
+            pthread_cond_wait(&io_done, &cache_lock);
+            n = 0;
+            i = -1;
+            continue;
+        }
+        if(slots[i].valid && slots[i].dirty && !slots[i].busy)
+            order[n++] = i;
+    }
+    for(i = 0 ; i < n ; i++)
+        slots[order[i]].busy = 1;
+    pthread_mutex_unlock(&cache_lock);
+
+    // write back in block order, neighbouring blocks as one run, all runs in one batch
+    qsort(order, n, sizeof(int64_t), compareSlots);
+    for(i = 0 ; i < n ; i = j) {
+        runs[nruns].blocknr = slots[order[i]].blocknr;
+        runs[nruns].blocks = bufs + i;
+        for(j = i ; j < n && slots[order[j]].blocknr == slots[order[i]].blocknr + (j - i) ; j++)
+            bufs[j] = slots[order[j]].data;
+        runs[nruns].count = j - i;
+        nruns++;
+    }
+
+    ret = rawWriteRuns(runs, nruns);
+
+    pthread_mutex_lock(&cache_lock);
+    for(i = 0 ; i < n ; i++) {
+        if(ret >= 0) {
+            slots[order[i]].dirty = 0;
+            cache_writebacks++;
+        }
+        slots[order[i]].busy = 0;
+    }
+    pthread_cond_broadcast(&io_done);
+    error_log("Flushed %lu blocks; hits = %lu, misses = %lu, write backs = %lu", n, cache_hits, cache_misses, cache_writebacks);
+    pthread_mutex_unlock(&cache_lock);
+
+    free(order);
+    free(bufs);
+    free(runs);
+    return ret < 0 ? ret : 0;
+}
+
+
+void destroyCache() {
+    error_log("%s called", __func__);
+
+    if(flushCache() < 0)
+        error_log("Dirty blocks lost, write back failed");
+
+    pthread_mutex_lock(&cache_lock);
+    free(slots);
+    free(pool);
+    free(buckets);
+    slots = NULL;
+    pool = NULL;
+    buckets = NULL;
+    slot_count = 0;
+    pthread_mutex_unlock(&cache_lock);
+}
@@ -0,0 +1,116 @@
+#include "dcache.h"
+
+uint64_t dcache_hits, dcache_misses;
+
+static dcache_entry slots[DCACHE_SLOTS];
+
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;    // protects the slots and counters
+
+// Error logging for THIS MODULE, helps differentiate from logging of other modules
+// Prints errors and logging info to STDOUT
+// Passes format strings and args to vprintf, basically a wrapper for printf
+static void error_log(char *fmt, ...) {
+#ifdef ERR_FLAG
+    va_list args;
+    va_start(args, fmt);
+
+    printf("DCACHE : ");
+    vprintf(fmt, args);
+    printf("\n");
+
+    va_end(args);
+#endif
+}
+
+
+// FNV-1a hash of a full path
+static uint32_t pathHash(const char *path) {
+    uint32_t hash = 2166136261u;
+
+    while(*path) {
+        hash ^= (uint8_t)*path++;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static void clearSlot(dcache_entry *entry) {
+    free(entry->path);
+    entry->path = NULL;
+    entry->node = NULL;
+}
+
+
+struct fs_tree_node *dcacheLookup(const char *path) {
+    uint32_t hash = pathHash(path);
+    dcache_entry *entry = &slots[hash & (DCACHE_SLOTS - 1)];
+    struct fs_tree_node *node = NULL;
+
+    pthread_mutex_lock(&dcache_lock);
+    if(entry->path && entry->hash == hash && !strcmp(entry->path, path))
+        node = entry->node;
+
+    if(node)
+        dcache_hits++;
+    else
+        dcache_misses++;
+    pthread_mutex_unlock(&dcache_lock);
+
+    error_log("%s on %s returning %p", __func__, path, node);
+    return node;
+}
+
+
+void dcacheInsert(const char *path, struct fs_tree_node *node) {
+    uint32_t hash = pathHash(path);
+    dcache_entry *entry = &slots[hash & (DCACHE_SLOTS - 1)];
+
+    char *copy = strdup(path);
+    if(!copy)
+        return;
+
+    pthread_mutex_lock(&dcache_lock);
+    free(entry->path);
+    entry->path = copy;
+    entry->hash = hash;
+    entry->node = node;
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+void dcacheInvalidate(const char *path, int recursive) {
+    error_log("%s called on %s, recursive = %d", __func__, path, recursive);
+
+    uint32_t hash = pathHash(path);
+    dcache_entry *entry = &slots[hash & (DCACHE_SLOTS - 1)];
+    size_t len = strlen(path);
+    uint64_t i;
+
+    pthread_mutex_lock(&dcache_lock);
+    if(entry->path && entry->hash == hash && !strcmp(entry->path, path))
+        clearSlot(entry);
+
+    if(recursive) {
+        // descendants hash anywhere, every slot has to be checked for the "path/" prefix
+        if(len == 1 && path[0] == '/')
+            len = 0;
+        for(i = 0 ; i < DCACHE_SLOTS ; i++) {
+            entry = &slots[i];
+            if(entry->path && !strncmp(entry->path, path, len) && entry->path[len] == '/')
+                clearSlot(entry);
+        }
+    }
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+
+void destroyDcache() {
+    error_log("%s called", __func__);
+
+    uint64_t i;
+    pthread_mutex_lock(&dcache_lock);
+    for(i = 0 ; i < DCACHE_SLOTS ; i++)
+        clearSlot(&slots[i]);
+    pthread_mutex_unlock(&dcache_lock);
+}
@@ -1,5 +1,34 @@
+#define _GNU_SOURCE         // O_DIRECT
 #include "disk.h"
+#include "cache.h"
+#include "journal.h"
 #include<unistd.h>
+#include<sys/uio.h>
+#include<sys/mman.h>
+#include<pthread.h>
+
+#ifdef FFS_IO_URING
+#include<liburing.h>
+#endif
+
+// Whole disk file mapped into memory when mounted with the mmap backend, else NULL
+static uint8_t *disk_map = NULL;
+static uint64_t disk_map_size = 0;
+
+// O_DIRECT descriptor for whole-block transfers, -1 when not in use
+static int direct_fd = -1;
+static void *direct_pool[DIRECT_POOL_BLOCKS];      // idle aligned bounce buffers
+static uint64_t direct_pool_count = 0;
+static pthread_mutex_t direct_lock = PTHREAD_MUTEX_INITIALIZER;     // protects the pool
+
+uint64_t inodes_per_block = INODES_PER_BLOCK;
+
+// Inode table and tail blocks seen since mount
+static shared_table inode_table = { .lock = PTHREAD_MUTEX_INITIALIZER };
+static shared_table tail_table = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int readTail(fs_tree_node *node, uint8_t *buf);
+static void freeTail(fs_tree_node *node);
 
 // Error logging for THIS MODULE, helps differentiate from logging of other modules
 // Prints errors and logging info to STDOUT
@@ -18,96 +47,92 @@ static void error_log(char *fmt, ...) {
 }
 
 
-void *allocate(fs_tree_node *node, uint64_t n) {
-    error_log("%s called on %p for %ld bytes", __func__, node, n);
-
-    n = n / (4 * 1024);
-    n += 1;
-    error_log("Going to allocate %ld blocks", n);
-    // n blocks are to be allocated
+// Index of the dirty buffer of `node` for file block `fblock`, or where it would be inserted if it does not exist yet.
+static uint32_t findDirty(fs_tree_node *node, uint64_t fblock) {
+    uint32_t lo = 0, hi = node->dirty_count, mid;
 
-    node->data = (uint8_t *)malloc(n * BLOCK_SIZE);
+    // appends are the common case, check the end first
+    if(!hi || node->dirty[hi - 1].fblock < fblock)
+        return hi;
 
-    if(!node->data)
-        return (void *)(-ENOMEM);
+    while(lo < hi) {
+        mid = (lo + hi) / 2;
+        if(node->dirty[mid].fblock < fblock)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
 
-    node->block_count = n;
-    return (void *)(node->data);
+    return lo;
 }
 
 
-void *reallocate(fs_tree_node *node, uint64_t n) {
-    error_log("%s called on %p for %ld bytes", __func__, node, n);
+uint8_t *dirtyBlock(fs_tree_node *node, uint64_t fblock, int fill) {
+    error_log("%s called on %p for file block %lu", __func__, node, fblock);
 
-    n = n / (4 * 1024);
-    n += 1;
-    // n blocks are to be allocated
-    error_log("Going to allocate %ld blocks", n);
-    void *temp_buf;
+    uint32_t i = findDirty(node, fblock);
+    if(i < node->dirty_count && node->dirty[i].fblock == fblock)
+        return node->dirty[i].buf;
 
-    if(!node->data)
-        temp_buf = malloc(n * BLOCK_SIZE);
-    else
-        temp_buf = realloc(node->data, n * BLOCK_SIZE);
+    // grown by doubling, a file written in small pieces adds a dirty block every few writes
+    if(node->dirty_count == node->dirty_cap) {
+        uint32_t size = node->dirty_cap ? node->dirty_cap * 2 : 16;
+        dirty_block *temp = realloc(node->dirty, sizeof(dirty_block) * size);
+        if(!temp) {
+            error_log("NO MEMORY!");
+            return NULL;
+        }
+        node->dirty = temp;
+        node->dirty_cap = size;
+    }
 
-    if(!temp_buf) {
+    uint8_t *buf = (uint8_t *)malloc(BLOCK_SIZE);
+    if(!buf) {
+        error_log("NO MEMORY!");
         return NULL;
     }
-    else
-        node->data = temp_buf;
-
-    node->block_count = n;
-    return node->data;
-}
 
+    uint64_t blocknr = fill ? lookupBlock(node, fblock) : 0;
+    if(blocknr)
+        readBlock(blocknr, buf);
+    else if(fill && !fblock && node->tail)
+        readTail(node, buf);
+    else
+        memset(buf, 0, BLOCK_SIZE);
 
-void *setBlocks(void *ptr, uint64_t n, int val) {
-    error_log("%s called on %p for %ld bytes to set %d", __func__, ptr, n, val);
+    memmove(node->dirty + i + 1, node->dirty + i, sizeof(dirty_block) * (node->dirty_count - i));
+    node->dirty[i].fblock = fblock;
+    node->dirty[i].buf = buf;
+    node->dirty_count += 1;
 
-    n = n * BLOCK_SIZE;
-    
-    return memset(ptr, n, val);
+    error_log("Returning with %p, dirty = %u", buf, node->dirty_count);
+    return buf;
 }
 
 
-void deallocate(fs_tree_node *node) {
-    error_log("%s called on %p", __func__);
-
-    if(!node->data)
-        free(node->data);
-    
-    node->data_size = 0;
-    node->block_count = 0;
-    node->data = NULL;
-}
-
+void dropDirtyBlocks(fs_tree_node *node, uint64_t from) {
+    error_log("%s called on %p from file block %lu", __func__, node, from);
 
-uint64_t constructBlock(fs_tree_node *node, void **ret) {
-    error_log("%s called on %p", __func__, node);
-    
-    uint64_t space_needed;
-    switch(node->type) {
-        case 1:
-            space_needed = NODE_SIZE + node->data_size;
-            break;
+    uint32_t i = findDirty(node, from), j;
+    for(j = i ; j < node->dirty_count ; j++)
+        free(node->dirty[j].buf);
+    node->dirty_count = i;
 
-        case 2:
-            space_needed = NODE_SIZE + (node->len * sizeof(node->inode_no));
-            break;
+    if(!node->dirty_count) {
+        free(node->dirty);
+        node->dirty = NULL;
+        node->dirty_cap = 0;
     }
-    uint64_t blocks_needed = (space_needed / BLOCK_SIZE) + 1;
-    // in every block, last 64 bytes are for storing next block number
-    // so additional space required =
-    space_needed += (blocks_needed * 64);
+}
 
-    // NODE_SIZE accounts for the next block field in the first block
-    space_needed -= 64;
 
-    blocks_needed = (space_needed / BLOCK_SIZE) + 1;    // Re-calculate blocks needed after adding
+int64_t constructBlock(fs_tree_node *node, void **ret) {
+    error_log("%s called on %p", __func__, node);
 
-    error_log("Space need = %lu\tBlocks needed = %lu", space_needed, blocks_needed);
+    uint64_t blocks_needed = 1 + node->ext_block_count;     // inode block + extent overflow blocks
+    error_log("Extents = %u\tBlocks needed = %lu", node->extent_count, blocks_needed);
 
-    void *store = malloc(blocks_needed * BLOCK_SIZE);
+    void *store = calloc(blocks_needed, BLOCK_SIZE);
     if(!store) {
         error_log("NO MEMORY!");
         return -ENOMEM;
@@ -115,7 +140,6 @@ uint64_t constructBlock(fs_tree_node *node, void **ret) {
     error_log("Storage allocated %p", store);
 
     uint64_t alloc = 0;     //bytes in (store) already allocated
-    uint64_t data_copied = 0;   //bytes of data copied
     
     memcpy(store + alloc, &(node->type), sizeof(node->type));
     alloc += sizeof(node->type);
@@ -177,58 +201,33 @@ uint64_t constructBlock(fs_tree_node *node, void **ret) {
 
     error_log("Done writing inode no %d, alloc = %d", node->inode_no, alloc);
 
-    // nothing to copy for next block, have to set manually later
-    uint64_t blocks_done = 0;
-    switch(node->type) {
-        case 1:
-            // copy data
-            if(node->data_size <= (BLOCK_SIZE - NODE_SIZE)) {
-                error_log("Writing at alloc = %lu, data_size %lu \t %4s", alloc, node->data_size, node->data);
-                memcpy(store + alloc, (node->data), (node->data_size));
-                alloc += (node->data_size);
-                data_copied += (node->data_size);
-            }
-            else {
-                error_log("Writing at alloc = %lu, data_size %lu", alloc, BLOCK_SIZE - NODE_SIZE);
-                memcpy(store + alloc, (node->data), (BLOCK_SIZE - NODE_SIZE));
-                alloc += (BLOCK_SIZE - NODE_SIZE);
-                data_copied += (BLOCK_SIZE - NODE_SIZE);
-                alloc += 8;
-            }
+    memcpy(store + alloc, &(node->extent_count), sizeof(node->extent_count));
+    alloc += sizeof(node->extent_count);
 
-            error_log("Done writing inline data, alloc = %d", alloc);
-            while(data_copied < node->data_size && (node->data_size - data_copied) > (BLOCK_SIZE - 8)) {
-                error_log("Writing at alloc = %lu, data_size %lu", alloc, BLOCK_SIZE - 8);
-                memcpy(store + alloc, (node->data) + data_copied, BLOCK_SIZE - 8);
-                alloc += (BLOCK_SIZE);
-                data_copied += (BLOCK_SIZE - 8);
-            }
+    uint64_t ext_next = node->ext_block_count ? node->ext_blocks[0] : node->tail;     // a file without extents may have a fragment instead
+    memcpy(store + alloc, &ext_next, sizeof(ext_next));
+    alloc += sizeof(ext_next);
 
-            if((node->data_size - data_copied) > 0) {
-                error_log("Writing at alloc = %lu, data_size %lu", alloc, (node->data_size - data_copied));
-                memcpy(store + alloc, (node->data) + data_copied, (node->data_size - data_copied));
-                alloc += ((node->data_size - data_copied));
-                data_copied += (node->data_size - data_copied);
-            }
-        break;
+    error_log("Done writing extent count %u and ext_next %lu, alloc = %d", node->extent_count, ext_next, alloc);
 
-        case 2:
-            //copy child inode nos
-            error_log("case 2 %d %lu", node->type, node->len);
-            for(data_copied = 0 ; data_copied < node->len ; data_copied++) {
-                memcpy(store + alloc, &(node->ch_inodes[data_copied]), sizeof(node->inode_no));
-                alloc += sizeof(node->inode_no);
-                error_log("Done writing child inode %lu, alloc = %lu", node->ch_inodes[data_copied], alloc);
-
-                if((alloc + 8) > (BLOCK_SIZE * blocks_done - 8)) {
-                    blocks_done++;
-                    alloc = blocks_done * BLOCK_SIZE;
-                }
-            }
-        break;
-    }
+    // copy extents, as many as fit in the inode block first, then fill the overflow blocks
+    uint32_t copied = node->extent_count < INLINE_EXTENTS ? node->extent_count : INLINE_EXTENTS;
+    memcpy(store + alloc, node->extents, copied * EXTENT_SIZE);
 
-    error_log("Done writing data, alloc = %d", alloc);
+    uint64_t blocks_done, n;
+    for(blocks_done = 1 ; blocks_done < blocks_needed ; blocks_done++) {
+        alloc = blocks_done * BLOCK_SIZE;
+        ext_next = (blocks_done < node->ext_block_count) ? node->ext_blocks[blocks_done] : 0;
+        memcpy(store + alloc, &ext_next, sizeof(ext_next));
+        alloc += sizeof(ext_next);
+
+        n = node->extent_count - copied;
+        if(n > EXTENTS_PER_BLOCK)
+            n = EXTENTS_PER_BLOCK;
+        memcpy(store + alloc, node->extents + copied, n * EXTENT_SIZE);
+        copied += n;
+        error_log("Done writing %lu extents to overflow block %lu", n, blocks_done);
+    }
 
     *ret = store;
 
@@ -311,155 +310,1667 @@ fs_tree_node *reconstructNode(void *blockdata) {
     alloc += sizeof(node->inode_no);
     error_log("Done reading inode %lu, alloc = %d", node->inode_no, alloc);
 
-    node->ch_inodes = (uint64_t *)malloc(sizeof(uint64_t) * node->len);
-    error_log("Starting to load child inodes");
+    memcpy(&(node->extent_count), blockdata + alloc, sizeof(node->extent_count));
+    alloc += sizeof(node->extent_count);
 
-    uint64_t i, temp, blocks_done = 0;
-    for(i = 0 ; i < node->len ; i++) {
-        memcpy(&temp, blockdata + alloc, sizeof(node->inode_no));
-        alloc += sizeof(node->inode_no);
-        node->ch_inodes[i] = temp;
-        error_log("Child %lu = %lu", i, temp);
+    uint64_t ext_next;
+    memcpy(&ext_next, blockdata + alloc, sizeof(ext_next));
+    alloc += sizeof(ext_next);
+    error_log("Done reading extent count %u and ext_next %lu, alloc = %d", node->extent_count, ext_next, alloc);
 
-        if((alloc + 8) > (BLOCK_SIZE - 8))
-            alloc = BLOCK_SIZE * ++blocks_done;
-    }
+    node->extents = (extent *)malloc(sizeof(extent) * node->extent_count);
+    uint32_t inline_count = node->extent_count < INLINE_EXTENTS ? node->extent_count : INLINE_EXTENTS;
+    memcpy(node->extents, blockdata + alloc, inline_count * EXTENT_SIZE);
+
+    // number of overflow blocks follows from the number of extents that did not fit inline
+    node->ext_block_count = (node->extent_count - inline_count + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+    node->ext_blocks = (uint64_t *)malloc(sizeof(uint64_t) * node->ext_block_count);
+    if(node->ext_block_count)
+        node->ext_blocks[0] = ext_next;
+
+    node->tail = node->extent_count ? 0 : ext_next;
+    node->ch_inodes = NULL;
+    node->block_count = 0;
 
     return node;
 }
 
 
-int openDisk(char *filename, int nbytes) {
-    error_log("%s called on %s", __func__, filename);
-    
-    int fd = open(filename, O_RDWR, 0666);
-    if(fd < 0) {
-        error_log("Problem = %d\t in %s", errno, __func__);
-        perror("openDisk problem");
-        exit(0);
+// Index of the last extent of `node` starting at or before file block `fblock`, -1 if there is none.
+static int64_t findExtent(fs_tree_node *node, uint64_t fblock) {
+    int64_t lo = 0, hi = (int64_t)node->extent_count - 1, mid, ret = -1;
+
+    while(lo <= hi) {
+        mid = (lo + hi) / 2;
+        if(node->extents[mid].logical <= fblock) {
+            ret = mid;
+            lo = mid + 1;
+        }
+        else
+            hi = mid - 1;
     }
 
-    error_log("Returning with fd = %d", fd);
-    return fd;
+    return ret;
 }
 
 
-int readBlock(uint64_t blocknr, void *block) {
-    error_log("%s called on fd : %d for block %d", __func__, diskfd, blocknr);
+uint64_t lookupBlock(fs_tree_node *node, uint64_t fblock) {
+    int64_t i = findExtent(node, fblock);
+    if(i < 0)
+        return 0;
 
-    int ret;
-    if(blocknr < MAX_BLOCK_NO){
-        error_log("Reading %d from offset %d", BLOCK_SIZE, blocknr * BLOCK_SIZE);
-        lseek(diskfd, blocknr * BLOCK_SIZE, SEEK_SET);
-        ret = read(diskfd, block, BLOCK_SIZE);
+    extent *e = &(node->extents[i]);
+    if(fblock < e->logical + e->length)
+        return e->start + (fblock - e->logical);
+
+    return 0;
+}
+
+
+// Add the run of `length` disk blocks at `start` as file blocks from `logical`, merging with neighbouring extents.
+// The file blocks must not be mapped yet.
+static int insertExtent(fs_tree_node *node, uint64_t logical, uint64_t start, uint64_t length) {
+    int64_t i = findExtent(node, logical);
+    extent *prev = (i >= 0) ? &(node->extents[i]) : NULL;
+    extent *next = (i + 1 < node->extent_count) ? &(node->extents[i + 1]) : NULL;
+
+    if(prev && prev->logical + prev->length == logical && prev->start + prev->length == start) {
+        // grows the previous extent, and may close the gap to the next one
+        prev->length += length;
+        if(next && next->logical == logical + length && next->start == start + length) {
+            prev->length += next->length;
+            memmove(next, next + 1, sizeof(extent) * (node->extent_count - i - 2));
+            node->extent_count -= 1;
+        }
     }
-    else{
-        return -EPERM;
+    else if(next && next->logical == logical + length && next->start == start + length) {
+        // grows the next extent backwards
+        next->logical -= length;
+        next->start -= length;
+        next->length += length;
+    }
+    else {
+        extent *temp = realloc(node->extents, sizeof(extent) * (node->extent_count + 1));
+        if(!temp) {
+            error_log("Error reallocing extents");
+            return -ENOMEM;
+        }
+        node->extents = temp;
+        memmove(node->extents + i + 2, node->extents + i + 1, sizeof(extent) * (node->extent_count - i - 1));
+        node->extents[i + 1].logical = logical;
+        node->extents[i + 1].start = start;
+        node->extents[i + 1].length = length;
+        node->extent_count += 1;
     }
 
-    error_log("Returning with %d", ret);
-    return ret;
+    node->block_count += length;
+    node->meta_dirty = 1;
+    return 0;
 }
 
 
-int writeBlock(uint64_t blocknr, void *block) {
-    error_log("%s called on fd : %d for block %d", __func__, diskfd, blocknr);
-    
-    int ret;
-    if(blocknr < MAX_BLOCK_NO){
-        error_log("Writing at off = %llu; size = %llu", (blocknr) * BLOCK_SIZE, BLOCK_SIZE);
-        lseek(diskfd, (blocknr) * BLOCK_SIZE, SEEK_SET);
-        ret = write(diskfd, block, BLOCK_SIZE);
+uint64_t mapBlocks(fs_tree_node *node, uint64_t fblock, uint64_t count) {
+    error_log("%s called on %p for file blocks %lu to %lu", __func__, node, fblock, fblock + count - 1);
+
+    uint64_t done = 0, gap, goal, start, got, prev;
+    int64_t i;
+
+    while(done < count) {
+        if(lookupBlock(node, fblock + done)) {
+            done++;
+            continue;
+        }
+
+        // unmapped stretch up to the next extent or the end of the request
+        gap = count - done;
+        i = findExtent(node, fblock + done);
+        if(i + 1 < node->extent_count && node->extents[i + 1].logical - (fblock + done) < gap)
+            gap = node->extents[i + 1].logical - (fblock + done);
+
+        // continue right after the previous file block, a fresh file starts next to its inode
+        prev = (fblock + done) ? lookupBlock(node, fblock + done - 1) : 0;
+        goal = prev ? prev + 1 : node->inode_no / inodes_per_block + 1;
+
+        start = allocBlocks(goal, gap, &got);
+        if(!got) {
+            error_log("Disk full after %lu blocks", done);
+            break;
+        }
+        if(insertExtent(node, fblock + done, start, got) < 0) {
+            for(i = 0 ; i < got ; i++)
+                clearBitofMap(start + i);
+            break;
+        }
+        done += got;
     }
-    else{
-        return -EPERM;
+
+    error_log("Returning with %lu, extents = %u", done, node->extent_count);
+    return done;
+}
+
+
+uint64_t mapBlock(fs_tree_node *node, uint64_t fblock) {
+    if(!mapBlocks(node, fblock, 1))
+        return 0;
+
+    return lookupBlock(node, fblock);
+}
+
+
+void unmapBlocks(fs_tree_node *node, uint64_t from) {
+    error_log("%s called on %p from file block %lu", __func__, node, from);
+
+    uint64_t keep, b;
+    extent *e;
+    while(node->extent_count) {
+        e = &(node->extents[node->extent_count - 1]);
+        if(e->logical + e->length <= from)
+            break;
+
+        keep = (e->logical < from) ? (from - e->logical) : 0;
+        for(b = keep ; b < e->length ; b++)
+            journalFree(e->start + b);
+        node->block_count -= (e->length - keep);
+        node->meta_dirty = 1;
+
+        if(keep) {
+            e->length = keep;
+            break;
+        }
+        node->extent_count -= 1;
     }
 
-    error_log("Returning with %d", ret);
-    return ret;
+    error_log("Done, extents = %u, blocks = %lu", node->extent_count, node->block_count);
 }
 
 
-uint64_t diskWriter(void *blocks_data, uint64_t blocks, uint64_t first) {
-    error_log("%s called on fd : %d for blocks %lu from first %lu", __func__, diskfd, blocks, first);
+int freeNodeBlocks(fs_tree_node *node) {
+    error_log("%s called on %p", __func__, node);
+
+    unmapBlocks(node, 0);
+
+    uint32_t i;
+    for(i = 0 ; i < node->ext_block_count ; i++)
+        journalFree(node->ext_blocks[i]);
+    node->ext_block_count = 0;
+
+    if(node->tail)
+        freeTail(node);
+
+    freeInode(node->inode_no);
+    return 0;
+}
+
 
-    uint64_t i, toWrite, next = first;
-    for(i = 0 ; i < blocks ; i++) {
-        toWrite = next;
-        setBitofMap(toWrite);
-        next = 0;
-        if(i != (blocks - 1))
-            next = findFirstFreeBlock();
-        
-        memcpy(blocks_data + (BLOCK_SIZE * (i+1) - 8), &next, sizeof(next)); // set the next block field
-        writeBlock(toWrite, blocks_data + (i * BLOCK_SIZE));
+// Entry of block `blocknr` in `table`, adding an empty one if it has none. Returns NULL if there is no memory.
+// Called with the table lock held.
+static shared_block *sharedBlock(shared_table *table, uint64_t blocknr) {
+    uint64_t i, mask;
+
+    if((table->count + 1) * 4 > table->size * 3) {
+        uint64_t old_size = table->size, size = old_size ? old_size * 2 : 64;
+        shared_block *old = table->entries, *temp = (shared_block *)calloc(size, sizeof(shared_block));
+        if(!temp)
+            return NULL;
+
+        table->entries = temp;
+        table->size = size;
+        for(i = 0 ; i < old_size ; i++) {
+            if(!old[i].blocknr)
+                continue;
+            mask = (old[i].blocknr * 0x9E3779B97F4A7C15ULL) & (size - 1);
+            while(table->entries[mask].blocknr)
+                mask = (mask + 1) & (size - 1);
+            table->entries[mask] = old[i];
+        }
+        free(old);
     }
 
-    error_log("Freeing input buffer after write %p", blocks_data);
-    //free(blocks_data); // throws error "invalid pointer" = reason unkown
-    error_log("Returning with %d", i);
+    i = (blocknr * 0x9E3779B97F4A7C15ULL) & (table->size - 1);
+    while(table->entries[i].blocknr && table->entries[i].blocknr != blocknr)
+        i = (i + 1) & (table->size - 1);
 
-    return i;
+    if(!table->entries[i].blocknr) {
+        table->entries[i].blocknr = blocknr;
+        table->count++;
+    }
+    return &table->entries[i];
 }
 
 
-fs_tree_node *diskReader(uint64_t block) {
-    error_log("%s called on fd : %d from block %d", __func__, diskfd, block);
-    
-    void *buf = calloc(sizeof(uint8_t), BLOCK_SIZE);
-    readBlock(block, buf);
-    fs_tree_node *node = reconstructNode(buf);
-    
-    node->fullname = NULL;
-    node->parent = NULL;
-    node->children = NULL;
-    node->data = NULL;
+// Put `entry` on the stack of blocks with room left, unless it is there already. Called with the table lock held.
+static void listShared(shared_table *table, shared_block *entry) {
+    if(entry->listed)
+        return;
 
-    if(!buf)
-        free(buf);
-    error_log("Returning with node = %p and len = %u", node, node->len);
-    return node;
+    if(table->partial_count == table->partial_cap) {
+        uint64_t cap = table->partial_cap ? table->partial_cap * 2 : 64;
+        uint64_t *temp = (uint64_t *)realloc(table->partial, cap * sizeof(uint64_t));
+        if(!temp)
+            return;     // not listed, its room is only used when it is the goal
+        table->partial = temp;
+        table->partial_cap = cap;
+    }
+    table->partial[table->partial_count++] = entry->blocknr;
+    entry->listed = 1;
 }
 
 
-uint64_t dataDiskReader(fs_tree_node *node) {
-    error_log("%s called on node : %p ", __func__, node);
+// Note the free records of table block `blocknr`, whose contents are in `block`, unless they are known already.
+// Called with the inode table lock held.
+static shared_block *discoverInodes(uint64_t blocknr, uint8_t *block) {
+    shared_block *entry = sharedBlock(&inode_table, blocknr);
+    if(!entry || entry->valid)
+        return entry;
+
+    uint64_t i;
+    entry->used = 0;
+    for(i = 0 ; i < inodes_per_block ; i++)
+        if(block[i * INODE_SIZE])
+            entry->used |= 1 << i;
+    entry->valid = 1;
+
+    if(entry->used != (1 << inodes_per_block) - 1)
+        listShared(&inode_table, entry);
+    return entry;
+}
 
-    uint64_t data_read = 0, next = 0;
-    node->data = (uint8_t *)malloc(sizeof(uint8_t) * node->data_size);
-    void *buf = malloc(sizeof(uint8_t *) * BLOCK_SIZE);
-    readBlock(node->inode_no, buf);
 
-    if(node->data_size <= (BLOCK_SIZE - NODE_SIZE)) {
-        error_log("1Copying %u", node->data_size);
-        memcpy(node->data, buf + NODE_SIZE - 8, node->data_size);
-        data_read += node->data_size;
+// Take a free record of the table block of `entry`, or return 0 if it has none. Called with the inode table lock held.
+static uint64_t takeInode(shared_block *entry) {
+    uint64_t i;
+    for(i = 0 ; i < inodes_per_block ; i++) {
+        if(!(entry->used & (1 << i))) {
+            entry->used |= 1 << i;
+            return entry->blocknr * inodes_per_block + i;
+        }
     }
-    else {
-        error_log("2Copying %u", BLOCK_SIZE - NODE_SIZE);
-        memcpy(node->data, buf + NODE_SIZE - 8, BLOCK_SIZE - NODE_SIZE);
-        data_read += BLOCK_SIZE - NODE_SIZE;
-        memcpy(&next, buf + BLOCK_SIZE - 8, sizeof(next));
+    return 0;
+}
+
+
+uint64_t allocInode(uint64_t goal) {
+    uint64_t got, blocknr, inode_no = 0;
+    shared_block *entry;
+
+    if(inodes_per_block == 1) {
+        blocknr = allocBlocks(goal, 1, &got);
+        return got ? blocknr : 0;
     }
-    
-    error_log("Done reading inline data = %d \tnext = %d", data_read, next);
 
-    while(next) {
-        readBlock(next, buf);
-        if((node->data_size - data_read) >= (BLOCK_SIZE - 8)) {
-            error_log("3Copying %u", BLOCK_SIZE - 8);
-            memcpy(node->data + data_read, buf, BLOCK_SIZE - 8);
-            memcpy(&next, buf + BLOCK_SIZE - 8, sizeof(next));
+    uint8_t *block = (uint8_t *)malloc(BLOCK_SIZE);
+    if(!block)
+        return 0;
+
+    pthread_mutex_lock(&inode_table.lock);
+
+    // next to the goal first, so inodes of one directory share table blocks
+    blocknr = goal / inodes_per_block;
+    entry = sharedBlock(&inode_table, blocknr);
+    if(entry && !entry->valid && readBlock(blocknr, block) >= 0)
+        entry = discoverInodes(blocknr, block);
+    if(entry && entry->valid)
+        inode_no = takeInode(entry);
+
+    // then any block known to have a free record, entries that filled up or were released since are dropped
+    while(!inode_no && inode_table.partial_count) {
+        entry = sharedBlock(&inode_table, inode_table.partial[inode_table.partial_count - 1]);
+        if(entry && entry->valid && (inode_no = takeInode(entry)))
+            break;
+        if(entry)
+            entry->listed = 0;
+        inode_table.partial_count--;
+    }
+
+    // else a new table block
+    if(!inode_no) {
+        blocknr = allocBlocks(goal / inodes_per_block, 1, &got);
+        if(got) {
+            memset(block, 0, BLOCK_SIZE);
+            journalWrite(blocknr, block);
+            entry = discoverInodes(blocknr, block);
+            if(entry)
+                inode_no = takeInode(entry);
+            else
+                journalFree(blocknr);
+        }
+    }
+
+    pthread_mutex_unlock(&inode_table.lock);
+    free(block);
+
+    error_log("%s with goal %lu returning %lu", __func__, goal, inode_no);
+    return inode_no;
+}
+
+
+void freeInode(uint64_t inode_no) {
+    if(inodes_per_block == 1) {
+        journalFree(inode_no);
+        return;
+    }
+
+    uint64_t blocknr = inode_no / inodes_per_block, slot = inode_no % inodes_per_block;
+    uint8_t *block = (uint8_t *)malloc(BLOCK_SIZE);
+    shared_block *entry;
+
+    pthread_mutex_lock(&inode_table.lock);
+    if(block && readBlock(blocknr, block) >= 0 && (entry = discoverInodes(blocknr, block))) {
+        entry->used &= ~(1 << slot);
+        if(!entry->used) {
+            // nothing left in the block, its contents no longer matter
+            entry->valid = 0;
+            journalFree(blocknr);
         }
         else {
-            error_log("4Copying %u", node->data_size - data_read);
-            memcpy(node->data + data_read, buf, (node->data_size - data_read));
-            memcpy(&next, buf + BLOCK_SIZE - 8, sizeof(next));
+            memset(block + (slot * INODE_SIZE), 0, INODE_SIZE);
+            journalWrite(blocknr, block);
+            entry->valid = 0;           // listed again with its new free record
+            discoverInodes(blocknr, block);
+        }
+    }
+    else
+        error_log("Could not release inode %lu, leaking it", inode_no);
+    pthread_mutex_unlock(&inode_table.lock);
+
+    free(block);
+}
+
+
+int readInode(uint64_t inode_no, void *buf) {
+    if(inodes_per_block == 1)
+        return readBlock(inode_no, buf);
+
+    uint64_t blocknr = inode_no / inodes_per_block, slot = inode_no % inodes_per_block;
+    int ret = readBlock(blocknr, buf);
+    if(ret < 0)
+        return ret;
+
+    pthread_mutex_lock(&inode_table.lock);
+    discoverInodes(blocknr, buf);
+    pthread_mutex_unlock(&inode_table.lock);
+
+    memmove(buf, buf + (slot * INODE_SIZE), INODE_SIZE);
+    memset(buf + INODE_SIZE, 0, BLOCK_SIZE - INODE_SIZE);
+    return BLOCK_SIZE;
+}
+
+
+int writeInode(uint64_t inode_no, void *record) {
+    if(inodes_per_block == 1)
+        return journalWrite(inode_no, record);
+
+    uint64_t blocknr = inode_no / inodes_per_block, slot = inode_no % inodes_per_block;
+    uint8_t *block = (uint8_t *)malloc(BLOCK_SIZE);
+    int ret;
+
+    if(!block)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&inode_table.lock);
+    ret = readBlock(blocknr, block);
+    if(ret >= 0) {
+        memcpy(block + (slot * INODE_SIZE), record, INODE_SIZE);
+        ret = journalWrite(blocknr, block);
+    }
+    pthread_mutex_unlock(&inode_table.lock);
+
+    free(block);
+    return ret;
+}
+
+
+// Note the free slots and room of tail block `blocknr`, whose contents are in `block`, unless they are known already.
+// Called with the tail table lock held.
+static shared_block *discoverTails(uint64_t blocknr, uint8_t *block) {
+    shared_block *entry = sharedBlock(&tail_table, blocknr);
+    if(!entry || entry->valid)
+        return entry;
+
+    tail_slot *slots = (tail_slot *)block;
+    uint64_t i, room = BLOCK_SIZE - TAIL_HEADER;
+    entry->used = 0;
+    for(i = 0 ; i < TAIL_SLOTS ; i++) {
+        if(slots[i].length) {
+            entry->used |= 1U << i;
+            room -= slots[i].length;
         }
+    }
+    entry->room = room;
+    entry->valid = 1;
+
+    if(~entry->used && entry->room)
+        listShared(&tail_table, entry);
+    return entry;
+}
+
 
-        error_log("Done reading more data = %d \tnext = %d", data_read, next);
+// Replace fragment `slot` of tail block `block` with `len` bytes of `data`, removing it if `len` is 0, and pack the fragments together again.
+// The fragments must fit. Returns 0 if successful, else a negative error.
+static int putFragment(uint8_t *block, uint64_t slot, const void *data, uint64_t len) {
+    uint8_t *packed = (uint8_t *)calloc(1, BLOCK_SIZE);
+    if(!packed)
+        return -ENOMEM;
+
+    tail_slot *old = (tail_slot *)block, *new = (tail_slot *)packed;
+    uint64_t i, pos = TAIL_HEADER;
+    for(i = 0 ; i < TAIL_SLOTS ; i++) {
+        if(i == slot) {
+            memcpy(packed + pos, data, len);
+            new[i].length = len;
+        }
+        else {
+            memcpy(packed + pos, block + old[i].offset, old[i].length);
+            new[i].length = old[i].length;
+        }
+        new[i].offset = new[i].length ? pos : 0;
+        pos += new[i].length;
     }
 
-    error_log("Done with %lu", data_read);
-    return data_read;
+    memcpy(block, packed, BLOCK_SIZE);
+    free(packed);
+    return 0;
+}
+
+
+// Remove fragment `tail` from its block, releasing the block if nothing is left in it. `block` is scratch space.
+// Called with the tail table lock held.
+static void dropFragment(uint64_t tail, uint8_t *block) {
+    uint64_t blocknr = tail / TAIL_SLOTS;
+    shared_block *entry;
+
+    if(readBlock(blocknr, block) < 0 || putFragment(block, tail % TAIL_SLOTS, NULL, 0) < 0) {
+        error_log("Could not release fragment %lu, leaking it", tail);
+        return;
+    }
+
+    if((entry = sharedBlock(&tail_table, blocknr)))
+        entry->valid = 0;
+    entry = discoverTails(blocknr, block);
+    if(entry && !entry->used) {
+        entry->valid = 0;
+        journalFree(blocknr);
+    }
+    else
+        journalWrite(blocknr, block);
+}
+
+
+// Store `len` bytes of `data` as the fragment of `node`, in place if they still fit in its tail block, else in a tail block with room or a new one next to the inode.
+// Returns 0 if successful, else a negative error and the old fragment is kept.
+static int packTail(fs_tree_node *node, const void *data, uint64_t len) {
+    uint8_t *block = (uint8_t *)malloc(BLOCK_SIZE);
+    uint64_t blocknr = 0, got = 0, slot = TAIL_SLOTS, old = node->tail;
+    shared_block *entry;
+    int ret = -ENOSPC;
+
+    if(!block)
+        return -ENOMEM;
+
+    pthread_mutex_lock(&tail_table.lock);
+
+    // a small file being rewritten usually still fits where it was
+    if(old) {
+        blocknr = old / TAIL_SLOTS;
+        if(readBlock(blocknr, block) >= 0 && (entry = discoverTails(blocknr, block)) && entry->room + ((tail_slot *)block)[old % TAIL_SLOTS].length >= len)
+            slot = old % TAIL_SLOTS;
+    }
+
+    // then a block with room, blocks too full for this fragment are taken off the stack until a fragment in them is freed
+    while(slot == TAIL_SLOTS && tail_table.partial_count) {
+        blocknr = tail_table.partial[tail_table.partial_count - 1];
+        entry = sharedBlock(&tail_table, blocknr);
+        if(entry && entry->valid && ~entry->used && entry->room >= len && readBlock(blocknr, block) >= 0) {
+            slot = __builtin_ctz(~entry->used);
+            break;
+        }
+        if(entry)
+            entry->listed = 0;
+        tail_table.partial_count--;
+    }
+
+    // else a new tail block
+    if(slot == TAIL_SLOTS) {
+        blocknr = allocBlocks(node->inode_no / inodes_per_block + 1, 1, &got);
+        if(got) {
+            memset(block, 0, BLOCK_SIZE);
+            slot = 0;
+        }
+    }
+
+    if(slot != TAIL_SLOTS && (ret = putFragment(block, slot, data, len)) >= 0) {
+        journalWrite(blocknr, block);
+        if((entry = sharedBlock(&tail_table, blocknr)))
+            entry->valid = 0;
+        discoverTails(blocknr, block);
+
+        node->tail = blocknr * TAIL_SLOTS + slot;
+        node->meta_dirty = 1;
+        if(old && old != node->tail)
+            dropFragment(old, block);
+    }
+    else if(got)
+        clearBitofMap(blocknr);
+
+    pthread_mutex_unlock(&tail_table.lock);
+    free(block);
+
+    error_log("%s stored %lu bytes of %p as fragment %lu", __func__, len, node, node->tail);
+    return ret < 0 ? ret : 0;
+}
+
+
+// Release the fragment of `node`.
+static void freeTail(fs_tree_node *node) {
+    uint8_t *block = (uint8_t *)malloc(BLOCK_SIZE);
+    if(!block) {
+        error_log("No memory to release fragment %lu, leaking it", node->tail);
+        return;
+    }
+
+    pthread_mutex_lock(&tail_table.lock);
+    dropFragment(node->tail, block);
+    pthread_mutex_unlock(&tail_table.lock);
+    free(block);
+
+    node->tail = 0;
+    node->meta_dirty = 1;
+}
+
+
+// Read the fragment of `node` into `buf`, padded with zeroes to BLOCK_SIZE.
+static int readTail(fs_tree_node *node, uint8_t *buf) {
+    uint64_t blocknr = node->tail / TAIL_SLOTS;
+    int ret = readBlock(blocknr, buf);
+    if(ret < 0) {
+        memset(buf, 0, BLOCK_SIZE);
+        return ret;
+    }
+
+    pthread_mutex_lock(&tail_table.lock);
+    discoverTails(blocknr, buf);
+    pthread_mutex_unlock(&tail_table.lock);
+
+    tail_slot frag = ((tail_slot *)buf)[node->tail % TAIL_SLOTS];
+    memmove(buf, buf + frag.offset, frag.length);
+    memset(buf + frag.length, 0, BLOCK_SIZE - frag.length);
+    return BLOCK_SIZE;
+}
+
+
+// Keep the data of a small file in a fragment, moving it there from its own blocks when it is rewritten.
+// Returns 0 if the file needs no blocks of its own, else a negative error.
+static int writeTail(fs_tree_node *node) {
+    if(!node->data_size && node->tail)
+        freeTail(node);
+
+    if(!node->data_size || !node->dirty_count)
+        return node->extent_count ? -EEXIST : 0;
+
+    if(node->dirty_count > 1 || node->dirty[0].fblock)
+        return -EINVAL;
+
+    int ret = packTail(node, node->dirty[0].buf, node->data_size);
+    if(ret < 0)
+        return ret;
+
+    unmapBlocks(node, 0);
+    dropDirtyBlocks(node, 0);
+    return 0;
+}
+
+
+int openDisk(char *filename, int nbytes) {
+    error_log("%s called on %s", __func__, filename);
+    
+    int fd = open(filename, O_RDWR, 0666);
+    if(fd < 0) {
+        error_log("Problem = %d\t in %s", errno, __func__);
+        perror("openDisk problem");
+        exit(0);
+    }
+
+    error_log("Returning with fd = %d", fd);
+    return fd;
+}
+
+
+int openDirectDisk(char *filename) {
+    error_log("%s called on %s", __func__, filename);
+
+    int fd = open(filename, O_RDWR | O_DIRECT);
+    if(fd < 0) {
+        error_log("Problem = %d\t in %s", errno, __func__);
+        return -errno;
+    }
+
+    direct_fd = fd;
+    error_log("Returning with direct fd = %d", fd);
+    return 0;
+}
+
+
+// Take an aligned bounce buffer from the pool, allocating one if the pool is empty
+static void *getBounce() {
+    void *buf = NULL;
+
+    pthread_mutex_lock(&direct_lock);
+    if(direct_pool_count)
+        buf = direct_pool[--direct_pool_count];
+    pthread_mutex_unlock(&direct_lock);
+
+    if(!buf && posix_memalign(&buf, BLOCK_SIZE, BLOCK_SIZE))
+        return NULL;
+    return buf;
+}
+
+// Return a bounce buffer to the pool, freeing it if the pool is full
+static void putBounce(void *buf) {
+    pthread_mutex_lock(&direct_lock);
+    if(direct_pool_count < DIRECT_POOL_BLOCKS) {
+        direct_pool[direct_pool_count++] = buf;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&direct_lock);
+
+    free(buf);
+}
+
+// preadv/pwritev `count` blocks through the O_DIRECT descriptor, IOV_BATCH at a time.
+// Blocks whose buffer isn't block aligned are copied through bounce buffers.
+static int directTransfer(int writing, uint64_t blocknr, uint64_t count, void **blocks) {
+    struct iovec iov[IOV_BATCH];
+    uint64_t done = 0, n, i;
+    ssize_t ret;
+    int err = 0;
+
+    while(done < count && !err) {
+        n = (count - done) < IOV_BATCH ? (count - done) : IOV_BATCH;
+        for(i = 0 ; i < n ; i++) {
+            iov[i].iov_len = BLOCK_SIZE;
+            iov[i].iov_base = blocks[done + i];
+            if((uintptr_t)blocks[done + i] % BLOCK_SIZE) {
+                iov[i].iov_base = getBounce();
+                if(!iov[i].iov_base) {
+                    n = i;
+                    err = -ENOMEM;
+                    break;
+                }
+                if(writing)
+                    memcpy(iov[i].iov_base, blocks[done + i], BLOCK_SIZE);
+            }
+        }
+        if(!n)
+            break;
+
+        do {
+            if(writing)
+                ret = pwritev(direct_fd, iov, n, (blocknr + done) * BLOCK_SIZE);
+            else
+                ret = preadv(direct_fd, iov, n, (blocknr + done) * BLOCK_SIZE);
+        } while(ret < 0 && errno == EINTR);
+
+        if(ret < 0) {
+            error_log("Problem = %d\t in %s", errno, __func__);
+            err = -errno;
+            ret = 0;
+        }
+
+        for(i = 0 ; i < n ; i++) {
+            if(iov[i].iov_base == blocks[done + i])
+                continue;
+            if(!writing && (i + 1) * BLOCK_SIZE <= ret)
+                memcpy(blocks[done + i], iov[i].iov_base, BLOCK_SIZE);
+            putBounce(iov[i].iov_base);
+        }
+
+        // O_DIRECT moves whole blocks, anything short is the end of the disk file
+        done += ret / BLOCK_SIZE;
+        if(ret < n * BLOCK_SIZE)
+            break;
+    }
+
+    if(err && !done)
+        return err;
+    return done;
+}
+
+
+int readBlock(uint64_t blocknr, void *block) {
+    if(blocknr >= MAX_BLOCK_NO)
+        return -EPERM;
+
+    // metadata not yet committed is newer than anything on disk
+    if(journalRead(blocknr, block))
+        return BLOCK_SIZE;
+
+    if(cacheEnabled())
+        return cacheRead(blocknr, block);
+
+    return rawReadBlock(blocknr, block);
+}
+
+
+int writeBlock(uint64_t blocknr, void *block) {
+    if(blocknr >= MAX_BLOCK_NO)
+        return -EPERM;
+
+    if(cacheEnabled())
+        return cacheWrite(blocknr, block);
+
+    return rawWriteBlock(blocknr, block);
+}
+
+
+int mapDisk() {
+    error_log("%s called on fd : %d", __func__, diskfd);
+
+    struct stat st;
+    if(fstat(diskfd, &st) < 0 || !st.st_size) {
+        error_log("Problem = %d\t in %s", errno, __func__);
+        return -errno;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfd, 0);
+    if(map == MAP_FAILED) {
+        error_log("Problem = %d\t in %s", errno, __func__);
+        return -errno;
+    }
+
+    disk_map = (uint8_t *)map;
+    disk_map_size = st.st_size;
+    error_log("Mapped %lu bytes at %p", disk_map_size, disk_map);
+    return 0;
+}
+
+
+void *diskAddress(uint64_t offset, uint64_t len) {
+    if(!disk_map || offset + len > disk_map_size)
+        return NULL;
+
+    return disk_map + offset;
+}
+
+
+int syncDisk(int wait) {
+    if(!disk_map)
+        return 0;
+
+    error_log("%s called, wait = %d", __func__, wait);
+    if(msync(disk_map, disk_map_size, wait ? MS_SYNC : MS_ASYNC) < 0)
+        return -errno;
+
+    return 0;
+}
+
+
+int flushDisk() {
+    error_log("%s called on fd : %d", __func__, diskfd);
+
+    int ret = syncDisk(1);
+    if(ret < 0)
+        return ret;
+
+    // O_DIRECT writes reach the same file, syncing either descriptor covers both
+    if(fdatasync(diskfd) < 0) {
+        error_log("Problem = %d\t in %s", errno, __func__);
+        return -errno;
+    }
+    return 0;
+}
+
+
+// Repeat pread/pwrite until all `len` bytes at `offset` are transferred, since either may stop short.
+// Reads stop early only at the end of the disk file. Inside the mapping this is a plain copy.
+static int64_t fullTransfer(int writing, void *buf, uint64_t len, uint64_t offset) {
+    uint64_t done = 0;
+    ssize_t ret;
+
+    void *addr = diskAddress(offset, len);
+    if(addr) {
+        if(writing)
+            memcpy(addr, buf, len);
+        else
+            memcpy(buf, addr, len);
+        return len;
+    }
+
+    while(done < len) {
+        if(writing)
+            ret = pwrite(diskfd, buf + done, len - done, offset + done);
+        else
+            ret = pread(diskfd, buf + done, len - done, offset + done);
+
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            error_log("Problem = %d\t in %s", errno, __func__);
+            return -errno;
+        }
+        if(!ret)
+            break;
+        done += ret;
+    }
+
+    return done;
+}
+
+
+int64_t readDisk(void *buf, uint64_t len, uint64_t offset) {
+    return fullTransfer(0, buf, len, offset);
+}
+
+
+int64_t writeDisk(void *buf, uint64_t len, uint64_t offset) {
+    return fullTransfer(1, buf, len, offset);
+}
+
+
+int rawReadBlock(uint64_t blocknr, void *block) {
+    error_log("%s called on fd : %d for block %d", __func__, diskfd, blocknr);
+
+    int ret;
+    if(blocknr < MAX_BLOCK_NO && direct_fd >= 0 && !disk_map) {
+        ret = directTransfer(0, blocknr, 1, &block);
+        if(ret > 0)
+            ret = BLOCK_SIZE;
+    }
+    else if(blocknr < MAX_BLOCK_NO){
+        error_log("Reading %d from offset %d", BLOCK_SIZE, blocknr * BLOCK_SIZE);
+        ret = readDisk(block, BLOCK_SIZE, blocknr * BLOCK_SIZE);
+    }
+    else{
+        return -EPERM;
+    }
+
+    error_log("Returning with %d", ret);
+    return ret;
+}
+
+
+int rawWriteBlock(uint64_t blocknr, void *block) {
+    error_log("%s called on fd : %d for block %d", __func__, diskfd, blocknr);
+    
+    int ret;
+    if(blocknr < MAX_BLOCK_NO && direct_fd >= 0 && !disk_map) {
+        ret = directTransfer(1, blocknr, 1, &block);
+        if(ret > 0)
+            ret = BLOCK_SIZE;
+    }
+    else if(blocknr < MAX_BLOCK_NO){
+        error_log("Writing at off = %llu; size = %llu", (blocknr) * BLOCK_SIZE, BLOCK_SIZE);
+        ret = writeDisk(block, BLOCK_SIZE, blocknr * BLOCK_SIZE);
+    }
+    else{
+        return -EPERM;
+    }
+
+    error_log("Returning with %d", ret);
+    return ret;
+}
+
+
+// preadv/pwritev `count` consecutive blocks from `blocknr` into/out of the separate buffers in `blocks`, IOV_BATCH at a time.
+static int vectoredTransfer(int writing, uint64_t blocknr, uint64_t count, void **blocks) {
+    struct iovec iov[IOV_BATCH];
+    uint64_t done = 0, n, i;
+    int64_t rest;
+    ssize_t ret;
+
+    if(blocknr + count > MAX_BLOCK_NO)
+        return -EPERM;
+
+    uint8_t *addr = diskAddress(blocknr * BLOCK_SIZE, count * BLOCK_SIZE);
+    if(addr) {
+        for(i = 0 ; i < count ; i++) {
+            if(writing)
+                memcpy(addr + i * BLOCK_SIZE, blocks[i], BLOCK_SIZE);
+            else
+                memcpy(blocks[i], addr + i * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        return count;
+    }
+
+    if(direct_fd >= 0)
+        return directTransfer(writing, blocknr, count, blocks);
+
+    while(done < count) {
+        n = (count - done) < IOV_BATCH ? (count - done) : IOV_BATCH;
+        for(i = 0 ; i < n ; i++) {
+            iov[i].iov_base = blocks[done + i];
+            iov[i].iov_len = BLOCK_SIZE;
+        }
+
+        if(writing)
+            ret = pwritev(diskfd, iov, n, (blocknr + done) * BLOCK_SIZE);
+        else
+            ret = preadv(diskfd, iov, n, (blocknr + done) * BLOCK_SIZE);
+
+        if(ret < 0) {
+            if(errno == EINTR)
+                continue;
+            error_log("Problem = %d\t in %s", errno, __func__);
+            return -errno;
+        }
+        if(!ret)
+            break;
+
+        done += ret / BLOCK_SIZE;
+        if(ret % BLOCK_SIZE) {
+            // finish the block that was only partly transferred
+            rest = fullTransfer(writing, blocks[done] + (ret % BLOCK_SIZE), BLOCK_SIZE - (ret % BLOCK_SIZE), (blocknr + done) * BLOCK_SIZE + (ret % BLOCK_SIZE));
+            if(rest < 0)
+                return rest;
+            done++;
+        }
+    }
+
+    return done;
+}
+
+
+int rawReadBlocks(uint64_t blocknr, uint64_t count, void **blocks) {
+    error_log("%s called for %lu blocks from %lu", __func__, count, blocknr);
+    return vectoredTransfer(0, blocknr, count, blocks);
+}
+
+
+int rawWriteBlocks(uint64_t blocknr, uint64_t count, void **blocks) {
+    error_log("%s called for %lu blocks from %lu", __func__, count, blocknr);
+    return vectoredTransfer(1, blocknr, count, blocks);
+}
+
+
+#ifdef FFS_IO_URING
+
+// Per thread io_uring, with room for the iovecs of URING_DEPTH pieces in flight
+typedef struct uring_ctx {
+    struct io_uring ring;
+    struct iovec iov[URING_DEPTH][IOV_BATCH];
+    block_run piece[URING_DEPTH];
+}uring_ctx;
+
+static pthread_key_t uring_key;
+static pthread_once_t uring_once = PTHREAD_ONCE_INIT;
+static int uring_unusable = 0;          // set once io_uring turned out not to work, everything then uses preadv/pwritev
+
+static void uringDestroy(void *arg) {
+    uring_ctx *ctx = (uring_ctx *)arg;
+    io_uring_queue_exit(&(ctx->ring));
+    free(ctx);
+}
+
+static void uringKey() {
+    if(pthread_key_create(&uring_key, uringDestroy))
+        uring_unusable = 1;
+}
+
+// This thread's ring, set up on first use. NULL if io_uring is not available.
+static uring_ctx *uringContext() {
+    pthread_once(&uring_once, uringKey);
+    if(uring_unusable)
+        return NULL;
+
+    uring_ctx *ctx = (uring_ctx *)pthread_getspecific(uring_key);
+    if(ctx)
+        return ctx;
+
+    ctx = (uring_ctx *)malloc(sizeof(uring_ctx));
+    if(!ctx)
+        return NULL;
+
+    int ret = io_uring_queue_init(URING_DEPTH, &(ctx->ring), 0);
+    if(ret < 0) {
+        error_log("io_uring not available (%d), falling back to preadv/pwritev", ret);
+        free(ctx);
+        uring_unusable = 1;
+        return NULL;
+    }
+
+    pthread_setspecific(uring_key, ctx);
+    return ctx;
+}
+
+// Give up on io_uring for good after a failure the ring may not recover from
+static void uringDisable(uring_ctx *ctx) {
+    uring_unusable = 1;
+    pthread_setspecific(uring_key, NULL);
+    uringDestroy(ctx);
+}
+
+// Submit the runs as readv/writev requests of up to IOV_BATCH blocks, URING_DEPTH at a time, and reap them.
+// Requests that complete short or fail are redone with preadv/pwritev. Returns -ENOSYS if io_uring can't be used.
+static int uringTransfer(int writing, block_run *runs, uint64_t nruns) {
+    uring_ctx *ctx = uringContext();
+    if(!ctx)
+        return -ENOSYS;
+
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    block_run *p;
+    uint64_t r = 0, off = 0, n, i;
+    int queued, reaped, ret, err = 0;
+
+    while(r < nruns) {
+        for(queued = 0 ; queued < URING_DEPTH && r < nruns ; ) {
+            n = runs[r].count - off;
+            if(!n) {
+                r++;
+                off = 0;
+                continue;
+            }
+            if(n > IOV_BATCH)
+                n = IOV_BATCH;
+
+            p = &(ctx->piece[queued]);
+            p->blocknr = runs[r].blocknr + off;
+            p->count = n;
+            p->blocks = runs[r].blocks + off;
+            for(i = 0 ; i < n ; i++) {
+                ctx->iov[queued][i].iov_base = p->blocks[i];
+                ctx->iov[queued][i].iov_len = BLOCK_SIZE;
+            }
+
+            sqe = io_uring_get_sqe(&(ctx->ring));
+            if(writing)
+                io_uring_prep_writev(sqe, diskfd, ctx->iov[queued], n, p->blocknr * BLOCK_SIZE);
+            else
+                io_uring_prep_readv(sqe, diskfd, ctx->iov[queued], n, p->blocknr * BLOCK_SIZE);
+            io_uring_sqe_set_data(sqe, p);
+
+            queued++;
+            off += n;
+        }
+        if(!queued)
+            break;
+
+        ret = io_uring_submit(&(ctx->ring));
+        if(ret != queued) {
+            // the ring is in an unknown state, do this batch and everything after synchronously
+            error_log("io_uring_submit returned %d for %d requests", ret, queued);
+            if(ret > 0) {
+                for(reaped = 0 ; reaped < ret ; reaped++) {
+                    while(io_uring_wait_cqe(&(ctx->ring), &cqe) == -EINTR);
+                    io_uring_cqe_seen(&(ctx->ring), cqe);
+                }
+            }
+            uringDisable(ctx);
+            return -ENOSYS;         // rewriting runs already done is harmless
+        }
+
+        for(reaped = 0 ; reaped < queued ; reaped++) {
+            ret = io_uring_wait_cqe(&(ctx->ring), &cqe);
+            if(ret == -EINTR) {
+                reaped--;
+                continue;
+            }
+            if(ret < 0) {
+                error_log("io_uring_wait_cqe returned %d", ret);
+                return ret;
+            }
+
+            p = (block_run *)io_uring_cqe_get_data(cqe);
+            if(cqe->res != (int)(p->count * BLOCK_SIZE)) {
+                ret = vectoredTransfer(writing, p->blocknr, p->count, p->blocks);
+                if(ret < 0)
+                    err = ret;
+            }
+            io_uring_cqe_seen(&(ctx->ring), cqe);
+        }
+    }
+
+    return err;
+}
+
+#endif
+
+
+// Transfer every run, through io_uring when built with it and it works, else one preadv/pwritev per IOV_BATCH blocks (or copy with the mmap backend)
+static int transferRuns(int writing, block_run *runs, uint64_t nruns) {
+    uint64_t r;
+    int ret;
+
+#ifdef FFS_IO_URING
+    if(!disk_map && direct_fd < 0)
+        ret = uringTransfer(writing, runs, nruns);
+    else
+        ret = -ENOSYS;          // the mapping is copied from directly, O_DIRECT needs its bounce buffers
+    if(ret != -ENOSYS)
+        return ret;
+#endif
+
+    for(r = 0 ; r < nruns ; r++) {
+        ret = vectoredTransfer(writing, runs[r].blocknr, runs[r].count, runs[r].blocks);
+        if(ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+
+int rawReadRuns(block_run *runs, uint64_t nruns) {
+    error_log("%s called for %lu runs", __func__, nruns);
+    return transferRuns(0, runs, nruns);
+}
+
+
+int rawWriteRuns(block_run *runs, uint64_t nruns) {
+    error_log("%s called for %lu runs", __func__, nruns);
+    return transferRuns(1, runs, nruns);
+}
+
+
+int writeRuns(block_run *runs, uint64_t nruns) {
+    if(!cacheEnabled())
+        return rawWriteRuns(runs, nruns);
+
+    uint64_t r;
+    int ret;
+    for(r = 0 ; r < nruns ; r++) {
+        ret = writeBlocks(runs[r].blocknr, runs[r].count, runs[r].blocks);
+        if(ret < 0)
+            return ret;
+    }
+
+    return 0;
+}
+
+
+int readBlocks(uint64_t blocknr, uint64_t count, void **blocks) {
+    int pending = journalPending(blocknr, count);
+    if(!cacheEnabled() && !pending)
+        return rawReadBlocks(blocknr, count, blocks);
+
+    uint64_t i;
+    int ret;
+    for(i = 0 ; i < count ; i++) {
+        ret = pending ? readBlock(blocknr + i, blocks[i]) : cacheRead(blocknr + i, blocks[i]);
+        if(ret < 0)
+            return ret;
+    }
+
+    return count;
+}
+
+
+int writeBlocks(uint64_t blocknr, uint64_t count, void **blocks) {
+    if(!cacheEnabled())
+        return rawWriteBlocks(blocknr, count, blocks);
+
+    uint64_t i;
+    int ret;
+    for(i = 0 ; i < count ; i++) {
+        ret = cacheWrite(blocknr + i, blocks[i]);
+        if(ret < 0)
+            return ret;
+    }
+
+    return count;
+}
+
+
+// Allocate or release extent overflow blocks so that exactly enough of them exist to hold the extents of `node`.
+static int syncExtentBlocks(fs_tree_node *node) {
+    uint32_t needed = 0;
+    if(node->extent_count > INLINE_EXTENTS)
+        needed = (node->extent_count - INLINE_EXTENTS + EXTENTS_PER_BLOCK - 1) / EXTENTS_PER_BLOCK;
+
+    if(needed > node->ext_block_count) {
+        uint64_t *temp = realloc(node->ext_blocks, sizeof(uint64_t) * needed);
+        if(!temp)
+            return -ENOMEM;
+        node->ext_blocks = temp;
+    }
+
+    uint64_t blocknr, got;
+    while(node->ext_block_count < needed) {
+        blocknr = allocBlocks(node->inode_no / inodes_per_block + 1, 1, &got);
+        if(!got)
+            return -ENOSPC;
+        node->ext_blocks[node->ext_block_count++] = blocknr;
+    }
+
+    while(node->ext_block_count > needed)
+        journalFree(node->ext_blocks[--(node->ext_block_count)]);
+
+    return 0;
+}
+
+
+// Lay out the entries of the children of `dir` in blocks, placed in `ret`. Returns the number of blocks, else a negative error.
+static int64_t packEntries(fs_tree_node *dir, void **ret) {
+    uint64_t i, len, pos = DIR_HEADER, blocks = 1;
+    uint8_t *store;
+
+    *ret = NULL;
+    if(!dir->len)
+        return 0;
+
+    for(i = 0 ; i < dir->len ; i++) {
+        len = DIR_ENTRY_HEAD + strlen(dir->children[i]->name);
+        if(pos + len > BLOCK_SIZE) {
+            blocks++;
+            pos = 0;
+        }
+        pos += len;
+    }
+
+    // blocks are padded with zeroes, which also marks the first one as holding entries
+    store = (uint8_t *)calloc(blocks, BLOCK_SIZE);
+    if(!store)
+        return -ENOMEM;
+
+    uint8_t *block = store;
+    pos = DIR_HEADER;
+    for(i = 0 ; i < dir->len ; i++) {
+        len = strlen(dir->children[i]->name);
+        if(pos + DIR_ENTRY_HEAD + len > BLOCK_SIZE) {
+            block += BLOCK_SIZE;
+            pos = 0;
+        }
+        memcpy(block + pos, &(dir->children[i]->inode_no), sizeof(uint64_t));
+        block[pos + 8] = dir->children[i]->type;
+        block[pos + 9] = len;
+        memcpy(block + pos + DIR_ENTRY_HEAD, dir->children[i]->name, len);
+        pos += DIR_ENTRY_HEAD + len;
+    }
+
+    *ret = store;
+    return blocks;
+}
+
+
+int64_t diskWriter(fs_tree_node *node) {
+    error_log("%s called on fd : %d for node %p at inode %lu", __func__, diskfd, node, node->inode_no);
+
+    uint64_t i, blocknr, blocks, mapped, nruns = 0, written = 0;
+    void *buf, **bufs = NULL;
+    block_run *runs = NULL;
+    uint32_t done, n;
+    int ret = 0, full = 0;
+
+    switch(node->type) {
+        case 1:
+            // small files keep their data in a fragment of a shared tail block
+            if(node->data_size <= TAIL_MAX && writeTail(node) == 0)
+                break;
+
+            // grown out of its fragment, the data moves to a block of its own
+            if(node->tail) {
+                if(!dirtyBlock(node, 0, 1))
+                    break;
+                freeTail(node);
+            }
+
+            if(!node->dirty_count)
+                break;
+
+            bufs = (void **)malloc(sizeof(void *) * node->dirty_count);
+            runs = (block_run *)malloc(sizeof(block_run) * node->dirty_count);
+            if(!bufs || !runs) {
+                error_log("Error allocating runs, nothing written");
+                free(bufs);
+                free(runs);
+                return -ENOMEM;
+            }
+
+            // only blocks changed since the last write go to disk, neighbours on disk as one run
+            for(done = 0 ; done < node->dirty_count ; done += n) {
+                // map a whole stretch of consecutive dirty blocks at once, so it gets one run on disk
+                n = 1;
+                while(n < IOV_BATCH && done + n < node->dirty_count && node->dirty[done + n].fblock == node->dirty[done].fblock + n)
+                    n++;
+
+                mapped = mapBlocks(node, node->dirty[done].fblock, n);
+                if(!mapped) {
+                    error_log("Disk full after %u dirty blocks", done);
+                    break;
+                }
+                blocknr = lookupBlock(node, node->dirty[done].fblock);
+
+                bufs[done] = node->dirty[done].buf;
+                n = 1;
+                while(n < mapped && lookupBlock(node, node->dirty[done + n].fblock) == blocknr + n) {
+                    bufs[done + n] = node->dirty[done + n].buf;
+                    n++;
+                }
+
+                runs[nruns].blocknr = blocknr;
+                runs[nruns].count = n;
+                runs[nruns].blocks = bufs + done;
+                nruns++;
+            }
+
+            // all runs of the file in one batch
+            ret = writeRuns(runs, nruns);
+            free(bufs);
+            free(runs);
+            if(ret < 0) {
+                // the blocks stay dirty and mapped, the next attempt writes them to the same places
+                saveBitMap();
+                error_log("Error %d writing %u dirty blocks, keeping them", ret, done);
+                return ret;
+            }
+            for(i = 0 ; i < done ; i++)
+                free(node->dirty[i].buf);
+            written += done;
+
+            // keep whatever could not be written for the next attempt
+            node->dirty_count -= done;
+            memmove(node->dirty, node->dirty + done, sizeof(dirty_block) * node->dirty_count);
+            if(!node->dirty_count) {
+                free(node->dirty);
+                node->dirty = NULL;
+                node->dirty_cap = 0;
+            }
+            else
+                full = 1;           // reported once the blocks that did fit are recorded in the inode
+            break;
+
+        case 2:
+            // entries only change while the children are in memory
+            if(!node->loaded)
+                break;
+
+            blocks = packEntries(node, &buf);
+            node->meta_dirty = 1;       // len changes along with the children
+            if((int64_t)blocks < 0) {
+                saveBitMap();
+                error_log("Error packing entries, directory not written");
+                return blocks;
+            }
+            unmapBlocks(node, blocks);
+            ret = (blocks && mapBlocks(node, 0, blocks) < blocks) ? -ENOSPC : 0;
+
+            // an inode listing more children than its blocks hold would lose the rest, it is written only once they all are
+            for(i = 0 ; i < blocks && ret >= 0 ; i++) {
+                ret = journalWrite(lookupBlock(node, i), buf + (i * BLOCK_SIZE));
+                written++;
+            }
+            free(buf);
+            if(ret < 0) {
+                saveBitMap();
+                error_log("Error %d writing entries, directory stays dirty", ret);
+                return ret;
+            }
+            break;
+    }
+
+    if(!node->meta_dirty) {
+        saveBitMap();
+        error_log("Metadata unchanged, returning with %d", written);
+        return full ? -ENOSPC : written;
+    }
+
+    if(syncExtentBlocks(node) < 0)
+        error_log("Could not allocate extent overflow blocks");
+
+    void *blocks_data = NULL;
+    int64_t meta = constructBlock(node, &blocks_data);
+    if(meta < 0) {
+        // metadata stays dirty, the next write of the node tries again
+        saveBitMap();
+        error_log("Error constructing inode, metadata not written");
+        return meta;
+    }
+    ret = writeInode(node->inode_no, blocks_data);
+    for(i = 1 ; i < meta && ret >= 0 ; i++)
+        ret = journalWrite(node->ext_blocks[i - 1], blocks_data + (i * BLOCK_SIZE));
+    free(blocks_data);
+    if(ret < 0) {
+        saveBitMap();
+        error_log("Error %d writing inode %lu, metadata stays dirty", ret, node->inode_no);
+        return ret;
+    }
+    written += meta;
+    node->meta_dirty = 0;
+
+    // blocks allocated or released above, and by the operation that led here
+    saveBitMap();
+
+    if(full) {
+        error_log("Disk full, %u blocks stay dirty", node->dirty_count);
+        return -ENOSPC;
+    }
+    error_log("Returning with %d", written);
+    return written;
+}
+
+
+int64_t dataRangeReader(fs_tree_node *node, void *dest, uint64_t offset, uint64_t size) {
+    error_log("%s called on node : %p for %lu bytes from offset %lu", __func__, node, size, offset);
+
+    uint64_t fblock, blocknr, chunk, skip, n, data_read = 0;
+    uint32_t d;
+    void *buf = NULL, *run[IOV_BATCH];
+    int ret = 0;
+
+    while(data_read < size) {
+        skip = (offset + data_read) % BLOCK_SIZE;          // only the first block can start mid-way
+        chunk = BLOCK_SIZE - skip;
+        if(chunk > size - data_read)
+            chunk = size - data_read;
+
+        fblock = (offset + data_read) / BLOCK_SIZE;
+        d = findDirty(node, fblock);
+        if(d < node->dirty_count && node->dirty[d].fblock == fblock) {
+            memcpy(dest + data_read, node->dirty[d].buf + skip, chunk);
+            data_read += chunk;
+            continue;
+        }
+
+        if(!fblock && node->tail) {
+            if(!buf && !(buf = malloc(BLOCK_SIZE))) {
+                ret = -ENOMEM;
+                break;
+            }
+            if((ret = readTail(node, buf)) < 0)
+                break;
+            memcpy(dest + data_read, buf + skip, chunk);
+            data_read += chunk;
+            continue;
+        }
+
+        blocknr = lookupBlock(node, fblock);
+        if(!blocknr)
+            memset(dest + data_read, 0, chunk);
+        else if(chunk == BLOCK_SIZE) {
+            // whole blocks go straight into the caller's buffer, a run of clean blocks that are neighbours on disk in one read
+            run[0] = dest + data_read;
+            n = 1;
+            while(n < IOV_BATCH && size - data_read >= (n + 1) * BLOCK_SIZE && lookupBlock(node, fblock + n) == blocknr + n) {
+                d = findDirty(node, fblock + n);
+                if(d < node->dirty_count && node->dirty[d].fblock == fblock + n)
+                    break;
+                run[n] = dest + data_read + (n * BLOCK_SIZE);
+                n++;
+            }
+
+            if((ret = readBlocks(blocknr, n, run)) < 0)
+                break;
+            data_read += n * BLOCK_SIZE;
+            continue;
+        }
+        else {
+            if(!buf && !(buf = malloc(BLOCK_SIZE))) {
+                ret = -ENOMEM;
+                break;
+            }
+            if((ret = readBlock(blocknr, buf)) < 0)
+                break;
+            memcpy(dest + data_read, buf + skip, chunk);
+        }
+        data_read += chunk;
+    }
+
+    free(buf);
+    if(ret < 0) {
+        error_log("Read failed with %d after %lu bytes", ret, data_read);
+        return ret;
+    }
+    error_log("Returning with %lu", data_read);
+    return data_read;
+}
+
+
+uint64_t dataRangeWriter(fs_tree_node *node, const void *src, uint64_t offset, uint64_t size) {
+    error_log("%s called on node : %p for %lu bytes at offset %lu", __func__, node, size, offset);
+
+    uint64_t chunk, skip, written = 0;
+    uint8_t *buf;
+
+    while(written < size) {
+        skip = (offset + written) % BLOCK_SIZE;
+        chunk = BLOCK_SIZE - skip;
+        if(chunk > size - written)
+            chunk = size - written;
+
+        // old contents are only needed when part of the block survives the write
+        buf = dirtyBlock(node, (offset + written) / BLOCK_SIZE, chunk != BLOCK_SIZE);
+        if(!buf)
+            break;
+
+        memcpy(buf + skip, src + written, chunk);
+        written += chunk;
+    }
+
+    if(offset + written > node->data_size) {
+        node->data_size = offset + written;
+        node->meta_dirty = 1;
+    }
+
+    error_log("Returning with %lu", written);
+    return written;
+}
+
+
+int truncateData(fs_tree_node *node, uint64_t size) {
+    error_log("%s called on node : %p from %lu to %lu bytes", __func__, node, node->data_size, size);
+
+    if(size < node->data_size) {
+        uint64_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        dropDirtyBlocks(node, blocks);
+        unmapBlocks(node, blocks);
+
+        // bytes past the end of file must read as zeroes if the file grows again
+        if(size % BLOCK_SIZE) {
+            uint8_t *buf = dirtyBlock(node, size / BLOCK_SIZE, 1);
+            if(!buf)
+                return -ENOMEM;
+            memset(buf + (size % BLOCK_SIZE), 0, BLOCK_SIZE - (size % BLOCK_SIZE));
+        }
+    }
+
+    node->data_size = size;
+    node->meta_dirty = 1;
+
+    return 0;
+}
+
+
+fs_tree_node *diskReader(uint64_t inode_no) {
+    error_log("%s called on fd : %d for inode %lu", __func__, diskfd, inode_no);
+    
+    void *buf = calloc(sizeof(uint8_t), BLOCK_SIZE);
+    if(!buf)
+        return (fs_tree_node *)(-ENOMEM);
+    int ret = readInode(inode_no, buf);
+    if(ret < 0) {
+        error_log("Could not read inode %lu", inode_no);
+        free(buf);
+        return (fs_tree_node *)(int64_t)ret;
+    }
+    fs_tree_node *node = reconstructNode(buf);
+    if((int64_t)node < 0) {
+        free(buf);
+        return node;
+    }
+
+    // remaining extents are in the chain of overflow blocks
+    uint32_t k, n, loaded = node->extent_count < INLINE_EXTENTS ? node->extent_count : INLINE_EXTENTS;
+    for(k = 0 ; k < node->ext_block_count ; k++) {
+        readBlock(node->ext_blocks[k], buf);
+        if(k + 1 < node->ext_block_count)
+            memcpy(&(node->ext_blocks[k + 1]), buf, sizeof(uint64_t));
+
+        n = node->extent_count - loaded;
+        if(n > EXTENTS_PER_BLOCK)
+            n = EXTENTS_PER_BLOCK;
+        memcpy(node->extents + loaded, buf + sizeof(uint64_t), n * EXTENT_SIZE);
+        loaded += n;
+    }
+
+    for(k = 0 ; k < node->extent_count ; k++)
+        node->block_count += node->extents[k].length;
+    
+    node->fullname = NULL;
+    node->parent = NULL;
+    node->children = NULL;
+    node->child_index = NULL;
+    node->index_size = node->index_used = 0;
+    node->loaded = 0;
+    node->last_used = 0;
+    pthread_rwlock_init(&node->lock, NULL);
+    node->dirty = NULL;
+    node->dirty_count = 0;
+    node->dirty_cap = 0;
+    node->meta_dirty = 0;
+    node->stub = 0;
+
+    free(buf);
+    error_log("Returning with node = %p and len = %u", node, node->len);
+    return node;
+}
+
+int64_t readEntries(fs_tree_node *dir, dir_entry *entries) {
+    error_log("%s called on %p with %u children", __func__, dir, dir->len);
+
+    uint64_t blocks = dir->block_count, i, pos, n = 0, marker = 0;
+    if(!dir->len || !blocks)
+        return 0;
+
+    uint8_t *store = (uint8_t *)malloc(blocks * BLOCK_SIZE);
+    if(!store)
+        return -ENOMEM;
+
+    // all blocks at once, neighbours on disk are read as one run
+    int64_t ret = dataRangeReader(dir, store, 0, blocks * BLOCK_SIZE);
+    if(ret < 0) {
+        free(store);
+        return ret;
+    }
+    memcpy(&marker, store, sizeof(marker));
+
+    if(marker) {
+        // written before entries had names, only the inode numbers are there
+        for(n = 0 ; n < dir->len && (n + 1) * sizeof(uint64_t) <= blocks * BLOCK_SIZE ; n++) {
+            memcpy(&(entries[n].inode_no), store + (n * sizeof(uint64_t)), sizeof(uint64_t));
+            entries[n].type = 0;
+            entries[n].name[0] = 0;
+        }
+        free(store);
+        return n;
+    }
+
+    uint8_t *block, len;
+    for(i = 0 ; i < blocks && n < dir->len ; i++) {
+        block = store + (i * BLOCK_SIZE);
+        for(pos = i ? 0 : DIR_HEADER ; n < dir->len && pos + DIR_ENTRY_HEAD <= BLOCK_SIZE ; pos += DIR_ENTRY_HEAD + len) {
+            memcpy(&(entries[n].inode_no), block + pos, sizeof(uint64_t));
+            if(!entries[n].inode_no)
+                break;
+            entries[n].type = block[pos + 8];
+            len = block[pos + 9];
+            if(pos + DIR_ENTRY_HEAD + len > BLOCK_SIZE)
+                break;
+            memcpy(entries[n].name, block + pos + DIR_ENTRY_HEAD, len);
+            entries[n].name[len] = 0;
+            n++;
+        }
+    }
+
+    free(store);
+    error_log("Returning with %lu entries", n);
+    return n;
 }
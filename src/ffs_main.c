@@ -9,9 +9,12 @@
 #include <sys/stat.h>
 #include <errno.h>
 
+#include <stddef.h>
+
 #include <fuse.h>
 #include "ffs_operations.h"
 #include "tree.h"
+#include "cache.h"
 
 
 // macros for backward compatibility
@@ -20,6 +23,33 @@
 char *path_to_mount;
 int diskfd;
 
+// Mount options understood by FFS itself, passed as `-o name=value`. Everything else is left for FUSE.
+struct ffs_options {
+    unsigned long cache_blocks;         // size of the block cache in blocks, 0 disables it
+    unsigned long max_nodes;            // FS tree nodes kept in memory, 0 for no limit
+    unsigned long scan_threads;         // threads reading the whole tree at mount, 0 to load directories on demand
+    unsigned long commit_interval;      // seconds between commits of buffered changes, 0 for the default
+    int use_mmap;                       // map the disk file into memory instead of using pread/pwrite
+    int use_direct;                     // move whole blocks with O_DIRECT, bypassing the host page cache
+};
+
+static struct ffs_options options = {
+    .cache_blocks = DEFAULT_CACHE_BLOCKS,
+    .max_nodes = DEFAULT_NODE_BUDGET,
+};
+
+#define FFS_OPT(t, p) { t, offsetof(struct ffs_options, p), 0 }
+
+static struct fuse_opt ffs_opts[] = {
+    FFS_OPT("cache=%lu", cache_blocks),
+    FFS_OPT("max_nodes=%lu", max_nodes),
+    FFS_OPT("scan_threads=%lu", scan_threads),
+    FFS_OPT("commit=%lu", commit_interval),
+    { "mmap", offsetof(struct ffs_options, use_mmap), 1 },
+    { "odirect", offsetof(struct ffs_options, use_direct), 1 },
+    FUSE_OPT_END
+};
+
 static struct fuse_operations ffs_operations = {
     .getattr    = ffs_getattr,
     //.readlink = ffs_readlink,
@@ -38,24 +68,24 @@ static struct fuse_operations ffs_operations = {
 	.write	    = ffs_write,
 	//.statfs	    = ffs_statfs,
 	.flush	    = ffs_flush,
-	//.release	= ffs_release,
-	//.fsync	    = ffs_fsync,
+	.release	= ffs_release,
+	.fsync	    = ffs_fsync,
 	//.setxattr	= ffs_setxattr,
 	//.getxattr	= ffs_getxattr,
 	//.listxattr	= ffs_listxattr,
 	//.removexattr = ffs_removexattr,
 	//.opendir	= ffs_opendir,
-	.readdir	= ffs_readdir,/*
+	.readdir	= ffs_readdir,
 	//.releasedir	= ffs_releasedir,
-	//.fsyncdir	= ffs_fsyncdir,
-	.init	    = ffs_init,
-	.destroy	= ffs_destroy,
+	.fsyncdir	= ffs_fsyncdir,
+	.init	    = ffs_init,/*
 	.access	    = ffs_access,
 	.create	    = ffs_create,
 	.ftruncate	= ffs_ftruncate,
 	.fgetattr	= ffs_fgetattr,
 	//.lock	    = ffs_lock,*/
 	.utime	= ffs_utimens,
+	.destroy	= ffs_destroy,
 	/*.bmap	    = ffs_bmap,
 	//.ioctl	    = ffs_ioctl,
 	//.poll	    = ffs_poll,
@@ -67,7 +97,57 @@ static struct fuse_operations ffs_operations = {
 
 int main(int argc, char **argv) {
     diskfd = openDisk(argv[argc-1]);
+
+    struct fuse_args args = FUSE_ARGS_INIT(argc-1, argv);
+    if(fuse_opt_parse(&args, &options, ffs_opts, NULL) == -1)
+        return 1;
+
+    if(options.use_mmap) {
+        // the host page cache already holds the mapped blocks, a block cache would only copy them again
+        options.cache_blocks = 0;
+        if(mapDisk() < 0) {
+            perror("mapDisk problem");
+            return 1;
+        }
+    }
+    else if(options.use_direct) {
+        // the block cache becomes the only cache of the disk file
+        if(openDirectDisk(argv[argc-1]) < 0) {
+            perror("openDirectDisk problem");
+            return 1;
+        }
+    }
+
+    if(initCache(options.cache_blocks) < 0) {
+        perror("initCache problem");
+        return 1;
+    }
+
+    // replay what a crash left in the journal before anything is read, the mmap backend can't order its writes so it only replays
+    int unclean = openJournal(options.use_mmap);
+    if(unclean < 0) {
+        perror("openJournal problem");
+        return 1;
+    }
+
     //init_fs();
-	load_fs(diskfd);
-    return fuse_main(argc-1, argv, &ffs_operations);
+    if(options.commit_interval)
+        commit_interval = options.commit_interval;
+    node_budget = options.max_nodes;
+    if(load_fs(diskfd) < 0) {
+        perror("load_fs problem");
+        return 1;
+    }
+    // blocks released just before a crash may never have been marked free on disk
+    if(unclean && rebuild_bitmap() < 0) {
+        perror("rebuild_bitmap problem");
+        return 1;
+    }
+    if(options.scan_threads && scan_fs_tree(options.scan_threads) < 0) {
+        perror("scan_fs_tree problem");
+        return 1;
+    }
+    int ret = fuse_main(args.argc, args.argv, &ffs_operations);
+    fuse_opt_free_args(&args);
+    return ret;
 }
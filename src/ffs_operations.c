@@ -20,15 +20,8 @@ static void error_log(char *fmt, ...) {
 }
 
 
-int ffs_getattr(const char *path, struct stat *s) {
-    error_log("%s called on path : %s", __func__, path);
-
-    fs_tree_node *curr = NULL;
-    if(!(curr = node_exists(path))) {
-        error_log("curr = %p ; not found returning!", curr);
-        return -ENOENT;
-    }
-
+// Fill `s` from `curr`, whose lock the caller holds
+static int fill_stat(fs_tree_node *curr, struct stat *s) {
     memset(s, 0, sizeof(struct stat));
 
     s->st_dev = 666;
@@ -55,22 +48,46 @@ int ffs_getattr(const char *path, struct stat *s) {
     s->st_gid = curr->gid;
 
     s->st_size = curr->data_size;
-    s->st_blocks = ((curr->data_size + NODE_SIZE) / 4096) + 1;
+    s->st_blocks = curr->block_count + 1;      // data blocks + inode record
     s->st_blocks *= 8;
 
     s->st_atime = (curr->st_atim).tv_sec;
     s->st_mtime = (curr->st_mtim).tv_sec;
     s->st_ctime = (curr->st_ctim).tv_sec;
-    
+
     return 0;
 }
 
 
+int ffs_getattr(const char *path, struct stat *s) {
+    error_log("%s called on path : %s", __func__, path);
+
+    trim_fs_tree();        // no nodes are held yet, a safe point to evict
+
+    pthread_rwlock_rdlock(&tree_lock);
+    fs_tree_node *curr = NULL;
+    if(!(curr = node_exists(path))) {
+        pthread_rwlock_unlock(&tree_lock);
+        error_log("curr = %p ; not found returning!", curr);
+        return -ENOENT;
+    }
+
+    pthread_rwlock_rdlock(&curr->lock);
+    int ret = fill_stat(curr, s);
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
+    return ret;
+}
+
+
 int ffs_mknod(const char *path, mode_t m, dev_t d) {
     error_log("%s called on path : %s", __func__, path);
 
     error_log("Add FS tree node at path : %s", path);
+    journalThrottle();
+    pthread_rwlock_wrlock(&tree_lock);
     long int ret = (uint64_t)add_fs_tree_node(path, 1);
+    pthread_rwlock_unlock(&tree_lock);
     if(ret < 0) {
         return (int)ret;
     }
@@ -83,7 +100,10 @@ int ffs_mkdir(const char *path, mode_t m) {
     error_log("%s called on path : %s", __func__, path);
 
     error_log("Add FS tree node at path : %s", path);
+    journalThrottle();
+    pthread_rwlock_wrlock(&tree_lock);
     long int ret = (uint64_t)add_fs_tree_node(path, 2);
+    pthread_rwlock_unlock(&tree_lock);
     if(ret < 0) {
         return (int)ret;
     }
@@ -97,13 +117,14 @@ int ffs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t of
 
     fs_tree_node *curr = NULL;
 
-    filler(buffer, ".", NULL, 0);
-    filler(buffer, "..", NULL, 0);
+    trim_fs_tree();
 
+    pthread_rwlock_rdlock(&tree_lock);
     curr = node_exists(path);       //check if it exists
 
     if(strcmp(path, "/")) {             //if its not root
         if(!curr) {
+            pthread_rwlock_unlock(&tree_lock);
             return -ENOENT;
         }
 
@@ -111,25 +132,64 @@ int ffs_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t of
     }
 
     error_log("Path : %s : found to exist with %d children", path, curr->len);
+    if(load_children(curr) < 0) {
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOMEM;
+    }
+
+    // "." and ".." are offsets 1 and 2, child i is i + 3, so a listing resumes where the last one filled the buffer
+    struct stat st;
+    memset(&st, 0, sizeof(st));
+    st.st_mode = S_IFDIR;
+    if(offset < 1 && filler(buffer, ".", &st, 1))
+        goto full;
+    if(offset < 2 && filler(buffer, "..", &st, 2))
+        goto full;
+
+    // the children of a loaded directory don't change while tree_lock is held for reading, so only one node lock is held at a time
+    fs_tree_node *child;
+    off_t i;
+    for(i = offset > 2 ? offset - 2 : 0 ; i < curr->len ; i++) {
+        child = curr->children[i];
+
+        // a child not looked up yet is only listed, its inode is not read for attributes the kernel looks up anyway
+        if(__atomic_load_n(&child->stub, __ATOMIC_ACQUIRE)) {
+            memset(&st, 0, sizeof(st));
+            st.st_ino = child->inode_no;
+            st.st_mode = (child->type == 2) ? S_IFDIR : S_IFREG;
+        }
+        else {
+            pthread_rwlock_rdlock(&child->lock);
+            fill_stat(child, &st);
+            pthread_rwlock_unlock(&child->lock);
+        }
 
-    int i;
-    for(i = 0 ; i < curr->len ; i++)
-        filler(buffer, curr->children[i]->name, NULL, 0);
+        if(filler(buffer, child->name, &st, i + 3))
+            break;
+    }
 
+full:
+    pthread_rwlock_unlock(&tree_lock);
     return 0;
 }
 
 
 int ffs_rmdir(const char *path) {
     error_log("%s called on path : %s", __func__, path);
+
+    journalThrottle();
+    pthread_rwlock_wrlock(&tree_lock);
     if(node_exists(path)->len != 0) {
         //printf("rmdir: failed to remove '%s': Directory not empty", path);
+        pthread_rwlock_unlock(&tree_lock);
         return -ENOTEMPTY;
     }
     // OS checks if path exists using getattr, no need to check explicitly
     // Just forward responsibility to tree.c function
 
-    return remove_fs_tree_node(path);
+    int ret = remove_fs_tree_node(path);
+    pthread_rwlock_unlock(&tree_lock);
+    return ret;
 }
 
 
@@ -137,7 +197,13 @@ int ffs_open(const char *path, struct fuse_file_info *fi)
 {   
     error_log("%s called on path : %s", __func__, path);
     
+    pthread_rwlock_rdlock(&tree_lock);
     fs_tree_node *curr = node_exists(path);
+    if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOENT;
+    }
+
     uint32_t check = 0;
     switch(fi->flags & O_ACCMODE) {
         case O_RDWR:
@@ -156,8 +222,13 @@ int ffs_open(const char *path, struct fuse_file_info *fi)
             break;
     }
 
-    error_log("%d %d %d", curr->perms, check, curr->perms & check);
-    if(curr->perms & check) {
+    pthread_rwlock_rdlock(&curr->lock);
+    uint32_t perms = curr->perms;
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
+
+    error_log("%d %d %d", perms, check, perms & check);
+    if(perms & check) {
         error_log("Allowed to open!");
         return 0;
     }
@@ -172,9 +243,13 @@ int ffs_read(const char *path, char *buf, size_t size, off_t offset,struct fuse_
 
     fs_tree_node *curr = NULL;
     size_t len;
+    pthread_rwlock_rdlock(&tree_lock);
     curr = node_exists(path);
-    dataDiskReader(curr);
-    error_log("Data disk read %s", curr->data);
+    if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOENT;
+    }
+    pthread_rwlock_rdlock(&curr->lock);
 
     len = curr->data_size;
 
@@ -185,13 +260,20 @@ int ffs_read(const char *path, char *buf, size_t size, off_t offset,struct fuse_
             size = len - offset;
         
         error_log("if offset < len\t %ld %d %ld", size, len, offset);
-        memcpy(buf, curr->data + offset, size);
+        int64_t ret = dataRangeReader(curr, buf, offset, size);
+        if(ret < 0) {
+            pthread_rwlock_unlock(&curr->lock);
+            pthread_rwlock_unlock(&tree_lock);
+            return ret;
+        }
     } 
     else {
         size = 0;
         strcpy(buf, "");
     }
 
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
     return size;
 }
 
@@ -202,38 +284,45 @@ int ffs_write(const char *path, const char *buf, size_t size, off_t offset, stru
 
     fs_tree_node *curr = NULL;
     size_t len = 0;
+    journalThrottle();
+    pthread_rwlock_rdlock(&tree_lock);
     curr = node_exists(path);
+    if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOENT;
+    }
+    pthread_rwlock_wrlock(&curr->lock);
     len = curr->data_size;
 
     error_log("curr found at %p with data %d", curr, len);
 
-    if (offset + size >= len){
-        void *new_buf = NULL;
-
-        new_buf = reallocate(curr, offset+size+1);
-        if (!new_buf && offset+size) {
-            error_log("Failed to realloc! %p && %d = %d", new_buf, offset+size, (!new_buf && offset+size));
-            return -ENOMEM;
-        }
-        else if(new_buf != curr->data)
-            curr->data = new_buf;
-
-        error_log("successfuly realloced to %d!", offset+size+1);
-
-        memset(curr->data + offset, 0, size);
-        
-        error_log("Erased data from offset %d to size %d!", offset, size);
-        //curr->data = new_buf;
-        curr->data_size = offset + size;
-        error_log("curr->data_size %lu", curr->data_size);
+    // only the blocks covered by this write are touched, and only they get written by the flush
+    if(dataRangeWriter(curr, buf, offset, size) < size) {
+        pthread_rwlock_unlock(&curr->lock);
+        pthread_rwlock_unlock(&tree_lock);
+        error_log("Failed to buffer the write!");
+        return -ENOMEM;
+    }
+    error_log("curr->data_size %lu", curr->data_size);
+
+    time(&(curr->st_mtim).tv_sec);
+    curr->st_ctim = curr->st_mtim;
+    curr->meta_dirty = 1;
+
+    // small writes gather in the dirty blocks, once there are enough they go to disk as a few long runs
+    int64_t ret = 0;
+    if(curr->dirty_count >= WRITEBACK_BLOCKS)
+        ret = diskWriter(curr);
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
+    if(ret < 0) {
+        error_log("Write back failed with %ld, the data stays buffered", ret);
+        return ret;
     }
-    
-    memcpy(curr->data + offset, buf, size);
 
+    // the rest waits for flush, fsync or the next commit interval
     error_log("Copied data! Returning with size %d!", size);
 
-    ffs_flush(path, NULL);
-
     return size;
 }
 
@@ -242,16 +331,24 @@ int ffs_utimens(const char *path, struct utimbuf *tv) {
     error_log("%s called on path : %s", __func__, path);
     error_log("atime = %s; mtime = %s ", ctime(&(tv->actime)), ctime(&(tv->modtime)));
 
+    pthread_rwlock_rdlock(&tree_lock);
     fs_tree_node *curr = node_exists(path);
 
-    if(!curr)
+    if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
         return -ENOENT;
+    }
+    pthread_rwlock_wrlock(&curr->lock);
     
     if(curr->st_atim.tv_sec < tv->actime)
         curr->st_atim.tv_sec = tv->actime;
 
     if(curr->st_mtim.tv_sec < tv->modtime)
         curr->st_mtim.tv_sec = tv->modtime;
+
+    curr->meta_dirty = 1;
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
     
     /*
     curr->st_atim.tv_nsec = tv[0].tv_nsec;
@@ -269,51 +366,33 @@ int ffs_truncate(const char* path, off_t size)
 
     fs_tree_node *curr = NULL;
     size_t len;
+    journalThrottle();
+    pthread_rwlock_rdlock(&tree_lock);
     curr = node_exists(path);
+    if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOENT;
+    }
+    pthread_rwlock_wrlock(&curr->lock);
     len = curr->data_size;
 
     error_log("curr found at %p with data %d", curr, len);
-    void *new_buf;
-    
-    if(len<size)      
-    {  	 
-    	 new_buf = reallocate(curr, size+1);
-    	 
-    	 if(!new_buf)
-    	 {
-      		return -ENOMEM;
-    	 }
-    	 
-    	 //memcpy(new_buf, curr->data, len);
-   		 //free(curr->data);
-   		 //curr->data = new_data;
-   	}
-   	else if(len>size)
-	{
-	
-		 new_buf = reallocate(curr, size+1);
-    	 
-    	 if(!new_buf)
-    	 {
-      		return -ENOMEM;
-    	 }
-	
-   		//memcpy(new_buf, curr->data, size);
-    	//free(curr->data);
-   	    //curr->data = new_buf;
-   	    
-   	 } 	 
-   	 
-   	 // Fill remaining space with zeroes
- 	 if(len<size)
- 	 {
-    	memset(curr->data + len, 0, size-len);
-  	 }
-  	 
- 	 // Update file size
-  	 curr->data_size = size;
-  	 
-  	 return 0;
+
+    if(truncateData(curr, size) < 0) {
+        pthread_rwlock_unlock(&curr->lock);
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOMEM;
+    }
+
+    time(&(curr->st_mtim).tv_sec);
+    curr->st_ctim = curr->st_mtim;
+
+    // blocks past the new end are already released, the inode must stop pointing at them
+    int64_t ret = diskWriter(curr);
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
+
+    return ret < 0 ? ret : 0;
     
 }
 
@@ -322,8 +401,12 @@ int ffs_unlink(const char *path)
  {
   
   	error_log("%s called on path : %s ;", __func__, path);
-    
-    return remove_fs_tree_node(path);
+
+    journalThrottle();
+    pthread_rwlock_wrlock(&tree_lock);
+    int ret = remove_fs_tree_node(path);
+    pthread_rwlock_unlock(&tree_lock);
+    return ret;
 
 }
 
@@ -331,19 +414,26 @@ int ffs_unlink(const char *path)
 int ffs_rename(const char *from, const char *to) {
     error_log("%s called from : %s ; to : %s", __func__, from, to);
 
+    // the whole rename is one change to the namespace, nothing else runs meanwhile
+    journalThrottle();
+    pthread_rwlock_wrlock(&tree_lock);
+
     // check if destination exists
     fs_tree_node *to_node = node_exists(to);
     fs_tree_node *from_node = node_exists(from);
     fs_tree_node *from_parent;
 
-    if(!from) {             // if from doesn't exist
+    if(!from_node) {             // if from doesn't exist
         error_log("from file not found");
+        pthread_rwlock_unlock(&tree_lock);
         return -ENOENT;
     }
 
+    // the node at from goes away, and with it every cached path under a directory
+    dcacheInvalidate(from, from_node->type == 2);
+
     if(from_node->type == 1) {   // if from node is a file
         error_log("from node is a file");
-        dataDiskReader(from_node);
         if(to_node) {   // if to node exists
             error_log("to node exists");
             if(to_node->type == 1) {    // if to node is also file
@@ -352,12 +442,17 @@ int ffs_rename(const char *from, const char *to) {
                 remove_fs_tree_node(to);    // remove dest file
                 error_log("to node was removed");
                 to_node = add_fs_tree_node(to, 1);        // create new file at dest
+                if((int64_t)to_node < 0) {
+                    pthread_rwlock_unlock(&tree_lock);
+                    return (int64_t)to_node;
+                }
                 error_log("to node was added");
                 copy_nodes(from_node, to_node);       // copy structs
                 error_log("from node was copied to to node");
 
                 // Now, remove from node without destroying from_node's members (since to is using its members)
                 from_parent = from_node->parent;      // get parent of source node
+                unindex_child(from_parent, from_node);
                 //if(!from_node->name)
                     //free(from_node->name);
                 if(!from_node->fullname)
@@ -389,15 +484,21 @@ int ffs_rename(const char *from, const char *to) {
                 // if to path is a dir, OS or FUSE changes to path to dir/(from_file_name), i.e, same file name as from path but inside the folder specified in the (to) path
                 error_log("to node is a dir, not yet implemented");
                 
+                pthread_rwlock_unlock(&tree_lock);
                 return -EISDIR; // return "is a dir"
             }
         }
         else {  // if to node does not exist
             to_node = add_fs_tree_node(to, 1);        // create file at dest
+            if((int64_t)to_node < 0) {
+                pthread_rwlock_unlock(&tree_lock);
+                return (int64_t)to_node;
+            }
             copy_nodes(from_node, to_node);    // copy from from to to
 
             // Now, remove from node without destroying from_node's members (since to is using its members)
             from_parent = from_node->parent;      // get parent of source node
+            unindex_child(from_parent, from_node);
             if(!from_node->name)
                 free(from_node->name);
             if(!from_node->fullname)
@@ -437,6 +538,7 @@ int ffs_rename(const char *from, const char *to) {
                 // this block will probably never execute
                 // if to path is a file and from is a dir, OS or FUSE will refuse automatically
 
+                pthread_rwlock_unlock(&tree_lock);
                 return -EEXIST;     //if it is a file, return "File already exists" error like Ubuntu does
             }
             else {
@@ -450,12 +552,17 @@ int ffs_rename(const char *from, const char *to) {
         }
 
         to_node = add_fs_tree_node(to, 2);    // create the directory
+        if((int64_t)to_node < 0) {
+            pthread_rwlock_unlock(&tree_lock);
+            return (int64_t)to_node;
+        }
         error_log("Added node");
         copy_nodes(from_node, to_node);
         error_log("Copied from to to");
 
         // Now, remove from node without destroying from_node's members (since to is using its members)
         from_parent = from_node->parent;      // get parent of source node
+        unindex_child(from_parent, from_node);
         if(!from_node->parent)
             free(from_node->name);
         if(!from_node->fullname)
@@ -485,24 +592,22 @@ int ffs_rename(const char *from, const char *to) {
         }
     }
 
-    void *buf;
-    uint64_t newblocks = constructBlock(from_parent, &buf);
-    diskWriter(buf, newblocks, from_parent->inode_no);
-    if(!buf)
-        free(buf);
-
-    newblocks = constructBlock(to_node, &buf);
-    diskWriter(buf, newblocks, to_node->inode_no);
-    if(!buf)
-        free(buf);
-
-    /*
-    newblocks = constructBlock(to_node->parent, &buf);
-    diskWriter(buf, newblocks, to_node->parent->inode_no);
-    if(!buf)
-        free(buf);*/
-
-    
+    // to_node now owns the data blocks, only the old inode is left over
+    freeInode(from_node->inode_no);
+    pthread_rwlock_destroy(&from_node->lock);
+    free(from_node->fullname);
+    free(from_node);
+    __atomic_sub_fetch(&tree_nodes, 1, __ATOMIC_RELAXED);
+
+    // whatever fails stays dirty and is written again by the next flush or commit
+    int64_t ret = diskWriter(from_parent), to_ret = diskWriter(to_node);
+    pthread_rwlock_unlock(&tree_lock);
+    if(ret >= 0)
+        ret = to_ret;
+    if(ret < 0) {
+        error_log("Writing the renamed node failed with %ld", ret);
+        return ret;
+    }
 
     error_log("end of %s reached, going to return 0", __func__);
 
@@ -513,42 +618,54 @@ int ffs_rename(const char *from, const char *to) {
 int ffs_chmod(const char *path, mode_t setPerm) {
     error_log("%s called on path : %s ; to set : %d", __func__, path, setPerm);
 
+    pthread_rwlock_rdlock(&tree_lock);
     fs_tree_node *curr = node_exists(path);
     if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
         error_log("File not found!");
         
         return -ENOENT;
     }
+    pthread_rwlock_wrlock(&curr->lock);
 
+    int ret = 0;
     uint32_t curr_uid = getuid();
     if(curr_uid == curr->uid || !curr_uid) {        // if owner is doing chmod or root is
         error_log("Current user (%d) has permissions to chmod", curr_uid);
 
         curr->perms = setPerm;
+        curr->meta_dirty = 1;
     }
     else {
         error_log("Current user (%d) DOESNT permissions to chown", curr_uid); 
-        return -EACCES;
+        ret = -EACCES;
     }
 
-    return 0;
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
+    return ret;
 }
 
 
 int ffs_chown(const char *path, uid_t u, gid_t g) {
     error_log("%s called on path : %s ; to set : u = %d\t g = %d", __func__, path, u, g);
 
+    pthread_rwlock_rdlock(&tree_lock);
     fs_tree_node *curr = node_exists(path);
     if(!curr) {
+        pthread_rwlock_unlock(&tree_lock);
         error_log("File not found!");
         
         return -ENOENT;
     }
+    pthread_rwlock_wrlock(&curr->lock);
 
     uid_t curr_user = getuid();
 
     if(curr_user != 0 && curr_user != curr->uid) {       // only root or owner can chown a file
         error_log("Current user (%d) DOESNT permissions to chown file owned by %d", curr_user, curr->uid); 
+        pthread_rwlock_unlock(&curr->lock);
+        pthread_rwlock_unlock(&tree_lock);
         return -EACCES;
     }
     error_log("Current user (%d) has permissions to chown", curr_user); 
@@ -559,6 +676,10 @@ int ffs_chown(const char *path, uid_t u, gid_t g) {
     if(g != -1)
         curr->gid = g;
 
+    curr->meta_dirty = 1;
+    pthread_rwlock_unlock(&curr->lock);
+    pthread_rwlock_unlock(&tree_lock);
+
     return 0;
 }
 
@@ -566,12 +687,76 @@ int ffs_chown(const char *path, uid_t u, gid_t g) {
 int ffs_flush(const  char *path, struct fuse_file_info *fi) {
     error_log("%s called on path : %s", __func__, path);
 
+    journalThrottle();
+    pthread_rwlock_rdlock(&tree_lock);
     fs_tree_node *node = node_exists(path);
-    void *buf = NULL;
-    uint64_t blocks = constructBlock(node, &buf);
-    diskWriter(buf, blocks, node->inode_no);
+    if(!node) {
+        pthread_rwlock_unlock(&tree_lock);
+        return -ENOENT;
+    }
+    pthread_rwlock_wrlock(&node->lock);
+    int64_t ret = 0;
+    if(node->dirty_count || node->meta_dirty)
+        ret = diskWriter(node);
+    pthread_rwlock_unlock(&node->lock);
+    pthread_rwlock_unlock(&tree_lock);
+    if(ret < 0) {
+        // the node stays dirty, a later flush or commit tries again
+        error_log("Writing file failed with %ld", ret);
+        return ret;
+    }
+    syncDisk(0);        // start writing back the mapped pages, no waiting
     error_log("Wrote file!");
-    //free(buf);    // free(): invalid pointer = error thrown, unknown reason
 
     return 0;
+}
+
+
+int ffs_release(const char *path, struct fuse_file_info *fi) {
+    error_log("%s called on path : %s", __func__, path);
+
+    return ffs_flush(path, fi);
+}
+
+
+int ffs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    error_log("%s called on path : %s ; datasync = %d", __func__, path, datasync);
+
+    int ret = ffs_flush(path, fi);
+    if(ret < 0)
+        return ret;
+
+    // fsyncs arriving together share one commit and one flush of the disk
+    return journalSync();
+}
+
+
+int ffs_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi) {
+    error_log("%s called on path : %s ; datasync = %d", __func__, path, datasync);
+
+    return ffs_fsync(path, datasync, fi);
+}
+
+
+void *ffs_init(void) {
+    error_log("%s called", __func__);
+
+    // FUSE has forked into the background by now, threads started in main would be left behind
+    journalStart();
+    return NULL;
+}
+
+
+void ffs_destroy(void *private_data) {
+    error_log("%s called", __func__);
+
+    // files still open at unmount and changed attributes may not have been written yet
+    sync_fs_tree();
+    closeJournal();
+    destroyCache();
+    syncDisk(1);
+    error_log("Cache hits = %lu ; misses = %lu ; write backs = %lu", cache_hits, cache_misses, cache_writebacks);
+
+    destroyDcache();
+    error_log("Dentry cache hits = %lu ; misses = %lu", dcache_hits, dcache_misses);
 }
\ No newline at end of file
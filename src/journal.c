@@ -0,0 +1,807 @@
+#include "journal.h"
+#include "cache.h"
+#include "tree.h"
+
+#include <time.h>
+
+static uint64_t journal_start = 0;      // first block of the region, the header
+static uint64_t journal_blocks = 0;     // blocks in the region, 0 if the disk has no journal
+static int journaling = 0;
+
+static uint64_t head = 1;               // block of the region the next transaction is written at
+static uint64_t seq = 1;                // number of the next transaction
+
+static transaction running;             // gathering metadata from operations
+static transaction committing;          // being written, still read from until it reaches the block cache
+static int journal_failed = 0;          // the running or a failed transaction lost a block, metadata writes and commits fail from then on
+static uint64_t *releasable = NULL;     // blocks freed by committed transactions, released when the tail moves past them
+static uint64_t releasable_count = 0, releasable_cap = 0;
+static uint64_t *logged = NULL;         // set of blocks in records a replay would apply, 0 for empty slots
+static uint64_t logged_size = 0;        // slots in logged, a power of 2 at least twice the journal
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;   // protects the transactions and releasable
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;    // one commit or reclaim at a time, protects head and seq
+static pthread_cond_t commit_wake = PTHREAD_COND_INITIALIZER;
+
+static uint64_t commits_started = 0, commits_done = 0;    // running transactions taken for commit, and those on disk
+
+static pthread_t committer;
+static int committer_started = 0, committer_stop = 0, commit_wanted = 0;
+
+uint64_t commit_interval = JOURNAL_COMMIT_SECONDS;
+
+// Error logging for THIS MODULE, helps differentiate from logging of other modules
+// Prints errors and logging info to STDOUT
+// Passes format strings and args to vprintf, basically a wrapper for printf
+static void error_log(char *fmt, ...) {
+#ifdef ERR_FLAG
+    va_list args;
+    va_start(args, fmt);
+
+    printf("JOURNAL : ");
+    vprintf(fmt, args);
+    printf("\n");
+
+    va_end(args);
+#endif
+}
+
+
+uint64_t journalSize(uint64_t nblocks) {
+    uint64_t size = nblocks / JOURNAL_FRACTION;
+
+    if(size < JOURNAL_MIN_BLOCKS)
+        size = JOURNAL_MIN_BLOCKS;
+    if(size > JOURNAL_MAX_BLOCKS)
+        size = JOURNAL_MAX_BLOCKS;
+    return size;
+}
+
+
+int journalEnabled() {
+    return journaling;
+}
+
+
+// Blocks a transaction of `count` metadata blocks takes in the journal : descriptors, the blocks and the commit block
+static uint64_t recordSize(uint64_t count) {
+    return (count + JOURNAL_TAGS - 1) / JOURNAL_TAGS + count + 1;
+}
+
+
+// FNV-1a over a block, continuing from `hash`
+static uint64_t blockHash(uint64_t hash, const uint8_t *block) {
+    uint64_t i;
+    for(i = 0 ; i < BLOCK_SIZE ; i++) {
+        hash ^= block[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static int64_t findEntry(transaction *t, uint64_t blocknr) {
+    if(!t->index_size)
+        return -1;
+
+    uint64_t slot = (blocknr * 0x9E3779B97F4A7C15ULL >> 17) & (t->index_size - 1);
+    while(t->index[slot] != -1) {
+        if(t->entries[t->index[slot]].blocknr == blocknr)
+            return t->index[slot];
+        slot = (slot + 1) & (t->index_size - 1);
+    }
+    return -1;
+}
+
+// Put entry `i` in the index, which must have a free slot
+static void indexEntry(transaction *t, int64_t i) {
+    uint64_t slot = (t->entries[i].blocknr * 0x9E3779B97F4A7C15ULL >> 17) & (t->index_size - 1);
+    while(t->index[slot] != -1)
+        slot = (slot + 1) & (t->index_size - 1);
+    t->index[slot] = i;
+}
+
+// Make room in `t` for `extra` more entries
+static int reserveEntries(transaction *t, uint64_t extra) {
+    uint64_t need = t->count + extra, i, size;
+
+    if(need > t->cap) {
+        for(size = t->cap ? t->cap : 64 ; size < need ; size *= 2);
+        journal_entry *temp = realloc(t->entries, sizeof(journal_entry) * size);
+        if(!temp)
+            return -ENOMEM;
+        t->entries = temp;
+        t->cap = size;
+    }
+
+    // keep the index at most half full
+    if(need * 2 > t->index_size) {
+        for(size = t->index_size ? t->index_size : 128 ; size < need * 2 ; size *= 2);
+        int64_t *index = (int64_t *)malloc(sizeof(int64_t) * size);
+        if(!index)
+            return -ENOMEM;
+        free(t->index);
+        t->index = index;
+        t->index_size = size;
+        for(i = 0 ; i < size ; i++)
+            t->index[i] = -1;
+        for(i = 0 ; i < t->count ; i++)
+            indexEntry(t, i);
+    }
+    return 0;
+}
+
+static int addEntry(transaction *t, uint64_t blocknr, void *block) {
+    if(reserveEntries(t, 1) < 0)
+        return -ENOMEM;
+
+    uint8_t *data = (uint8_t *)malloc(BLOCK_SIZE);
+    if(!data)
+        return -ENOMEM;
+    memcpy(data, block, BLOCK_SIZE);
+
+    t->entries[t->count].blocknr = blocknr;
+    t->entries[t->count].data = data;
+    indexEntry(t, t->count);
+    t->count++;
+    return 0;
+}
+
+static int addBlock(uint64_t **list, uint64_t *count, uint64_t *cap, uint64_t blocknr) {
+    if(*count == *cap) {
+        uint64_t size = *cap ? *cap * 2 : 64;
+        uint64_t *temp = realloc(*list, sizeof(uint64_t) * size);
+        if(!temp)
+            return -ENOMEM;
+        *list = temp;
+        *cap = size;
+    }
+    (*list)[(*count)++] = blocknr;
+    return 0;
+}
+
+// Free the blocks held by `t`, keeping its freed list
+static void dropEntries(transaction *t) {
+    uint64_t i;
+    for(i = 0 ; i < t->count ; i++)
+        free(t->entries[i].data);
+    free(t->entries);
+    free(t->index);
+    t->entries = NULL;
+    t->index = NULL;
+    t->count = t->cap = t->index_size = 0;
+}
+
+
+// Move the blocks and frees of `committing`, whose commit failed, back into the running transaction so the next commit writes them again.
+// Blocks written again since keep their newer contents. Called with the journal lock held.
+// Nothing is moved if there is no memory for all of it.
+static int requeueTransaction() {
+    uint64_t i, freed_count = running.freed_count + committing.freed_count;
+
+    if(reserveEntries(&running, committing.count) < 0)
+        return -ENOMEM;
+    if(freed_count > running.freed_cap) {
+        uint64_t *temp = realloc(running.freed, sizeof(uint64_t) * freed_count);
+        if(!temp)
+            return -ENOMEM;
+        running.freed = temp;
+        running.freed_cap = freed_count;
+    }
+
+    for(i = 0 ; i < committing.count ; i++) {
+        if(findEntry(&running, committing.entries[i].blocknr) >= 0) {
+            free(committing.entries[i].data);
+            continue;
+        }
+        running.entries[running.count] = committing.entries[i];
+        indexEntry(&running, running.count);
+        running.count++;
+    }
+    if(committing.freed_count)
+        memcpy(running.freed + running.freed_count, committing.freed, sizeof(uint64_t) * committing.freed_count);
+    running.freed_count = freed_count;
+
+    free(committing.entries);
+    free(committing.index);
+    free(committing.freed);
+    memset(&committing, 0, sizeof(committing));
+    return 0;
+}
+
+
+// Remember that a replay would write block `blocknr`. Called with the commit lock held.
+static void logBlock(uint64_t blocknr) {
+    uint64_t slot = (blocknr * 0x9E3779B97F4A7C15ULL >> 17) & (logged_size - 1);
+    while(logged[slot] && logged[slot] != blocknr)
+        slot = (slot + 1) & (logged_size - 1);
+    logged[slot] = blocknr;
+}
+
+static int wasLogged(uint64_t blocknr) {
+    uint64_t slot = (blocknr * 0x9E3779B97F4A7C15ULL >> 17) & (logged_size - 1);
+    while(logged[slot]) {
+        if(logged[slot] == blocknr)
+            return 1;
+        slot = (slot + 1) & (logged_size - 1);
+    }
+    return 0;
+}
+
+
+// Write the header saying replay starts at block `tail` of the region with transaction `first`, and wait for it.
+// `type` is JOURNAL_CLEAN once everything is in place at unmount, else JOURNAL_HEADER.
+static int writeHeader(uint64_t tail, uint64_t first, uint64_t type) {
+    uint8_t *buf = (uint8_t *)calloc(1, BLOCK_SIZE);
+    if(!buf)
+        return -ENOMEM;
+
+    journal_block *h = (journal_block *)buf;
+    h->magic = JOURNAL_MAGIC;
+    h->type = type;
+    h->seq = first;
+    h->value = tail;
+
+    int ret = rawWriteBlock(journal_start, buf);
+    free(buf);
+    if(ret < 0)
+        return ret;
+    return flushDisk();
+}
+
+// Clear the bits of every releasable block. Called with the commit lock held, once the tail has moved past them.
+static uint64_t releaseBlocks() {
+    uint64_t *list, count, i;
+
+    pthread_mutex_lock(&journal_lock);
+    list = releasable;
+    count = releasable_count;
+    releasable = NULL;
+    releasable_count = releasable_cap = 0;
+    pthread_mutex_unlock(&journal_lock);
+
+    for(i = 0 ; i < count ; i++)
+        clearBitofMap(list[i]);
+    free(list);
+
+    error_log("Released %lu blocks", count);
+    return count;
+}
+
+// Write back the block cache and make the disk durable, so every earlier transaction is in its real place,
+// then move the tail to `tail` and release what those transactions freed. Called with the commit lock held.
+static int checkpoint(uint64_t tail) {
+    // records stay replayable until their blocks are surely in their real places
+    int ret = flushCache();
+    if(ret >= 0)
+        ret = flushDisk();
+    if(ret < 0)
+        return ret;
+
+    ret = writeHeader(tail, seq, JOURNAL_HEADER);
+    if(ret < 0)
+        return ret;
+
+    // nothing before the tail is replayed anymore
+    memset(logged, 0, sizeof(uint64_t) * logged_size);
+    head = tail;
+    releaseBlocks();
+    return 0;
+}
+
+
+static int compareEntries(const void *a, const void *b) {
+    uint64_t x = (*(journal_entry **)a)->blocknr, y = (*(journal_entry **)b)->blocknr;
+    return (x > y) - (x < y);
+}
+
+// Write the blocks of `t` to their real places through the block cache, neighbours as one run
+static int writeHome(transaction *t) {
+    journal_entry **order = (journal_entry **)malloc(sizeof(journal_entry *) * t->count);
+    void **bufs = (void **)malloc(sizeof(void *) * t->count);
+    block_run *runs = (block_run *)malloc(sizeof(block_run) * t->count);
+    uint64_t i, j, nruns = 0;
+    int ret = -ENOMEM;
+
+    if(order && bufs && runs) {
+        for(i = 0 ; i < t->count ; i++)
+            order[i] = &(t->entries[i]);
+        qsort(order, t->count, sizeof(journal_entry *), compareEntries);
+
+        for(i = 0 ; i < t->count ; i = j) {
+            runs[nruns].blocknr = order[i]->blocknr;
+            runs[nruns].blocks = bufs + i;
+            for(j = i ; j < t->count && order[j]->blocknr == order[i]->blocknr + (j - i) ; j++)
+                bufs[j] = order[j]->data;
+            runs[nruns].count = j - i;
+            nruns++;
+        }
+        ret = writeRuns(runs, nruns);
+    }
+
+    free(order);
+    free(bufs);
+    free(runs);
+    return ret;
+}
+
+// Write `t` to the journal at `head` as descriptors, blocks and a commit block, in one batch
+static int writeRecord(transaction *t) {
+    uint64_t size = recordSize(t->count), i, k, n, done = 0;
+    uint64_t hash = 14695981039346656037ULL;
+    void **bufs = (void **)malloc(sizeof(void *) * size);
+    uint8_t *meta = (uint8_t *)calloc(size - t->count, BLOCK_SIZE);     // descriptors and the commit block
+    uint8_t *next = meta;
+    journal_block *jb;
+    int ret = -ENOMEM;
+
+    if(!bufs || !meta)
+        goto out;
+
+    for(i = 0 ; i < t->count ; i += n) {
+        n = (t->count - i < JOURNAL_TAGS) ? t->count - i : JOURNAL_TAGS;
+
+        jb = (journal_block *)next;
+        jb->magic = JOURNAL_MAGIC;
+        jb->type = JOURNAL_DESCRIPTOR;
+        jb->seq = seq;
+        jb->value = n;
+        for(k = 0 ; k < n ; k++)
+            ((uint64_t *)(next + sizeof(journal_block)))[k] = t->entries[i + k].blocknr;
+
+        hash = blockHash(hash, next);
+        bufs[done++] = next;
+        next += BLOCK_SIZE;
+
+        for(k = 0 ; k < n ; k++) {
+            hash = blockHash(hash, t->entries[i + k].data);
+            bufs[done++] = t->entries[i + k].data;
+        }
+    }
+
+    jb = (journal_block *)next;
+    jb->magic = JOURNAL_MAGIC;
+    jb->type = JOURNAL_COMMIT;
+    jb->seq = seq;
+    jb->value = hash;
+    bufs[done++] = next;
+
+    block_run run = { journal_start + head, size, bufs };
+    ret = rawWriteRuns(&run, 1);
+    if(ret >= 0)
+        ret = flushDisk();
+
+out:
+    free(bufs);
+    free(meta);
+    return ret;
+}
+
+// Commit `t`, which no operation adds to anymore. Called with the commit lock held.
+static int commitTransaction(transaction *t) {
+    uint64_t size = recordSize(t->count), i;
+    int ret;
+
+    // ordered : data blocks reach the disk before metadata pointing at them is committed,
+    // and with them the blocks of every earlier transaction
+    ret = flushCache();
+    if(ret >= 0)
+        ret = flushDisk();
+    if(ret < 0 || !t->count)
+        return ret;
+
+    error_log("Committing transaction %lu with %lu blocks at %lu", seq, t->count, head);
+
+    if(size > journal_blocks - 1) {
+        // can never fit, write it in place without the journal's protection
+        error_log("Transaction of %lu blocks too large for the journal", t->count);
+        ret = checkpoint(1);
+        if(ret >= 0)
+            ret = writeHome(t);
+        if(ret >= 0)
+            ret = flushCache();
+        return ret;
+    }
+
+    // earlier transactions are in their real places now, their space can be reused once the journal wraps
+    if(head + size > journal_blocks) {
+        ret = checkpoint(1);
+        if(ret < 0)
+            return ret;
+    }
+
+    ret = writeRecord(t);
+    if(ret < 0)
+        return ret;
+    for(i = 0 ; i < t->count ; i++)
+        logBlock(t->entries[i].blocknr);
+    head += size;
+    seq++;
+
+    // committed, the blocks can go to their real places whenever the cache writes them back
+    return writeHome(t);
+}
+
+
+int journalCommit() {
+    int locked = journaling;
+
+    // no operation is half way through its metadata while tree_lock is held for writing
+    if(locked)
+        pthread_rwlock_wrlock(&tree_lock);
+    pthread_mutex_lock(&commit_lock);
+    pthread_mutex_lock(&journal_lock);
+    if(journal_failed) {
+        pthread_mutex_unlock(&journal_lock);
+        if(locked)
+            pthread_rwlock_unlock(&tree_lock);
+        pthread_mutex_unlock(&commit_lock);
+        return -EIO;
+    }
+    committing = running;
+    memset(&running, 0, sizeof(running));
+    uint64_t number = ++commits_started;
+    pthread_mutex_unlock(&journal_lock);
+    if(locked)
+        pthread_rwlock_unlock(&tree_lock);
+
+    int ret = commitTransaction(&committing);
+
+    pthread_mutex_lock(&journal_lock);
+    if(ret < 0) {
+        // the blocks may not be anywhere on disk and the frees aren't durable, keep both for the next commit
+        error_log("Commit failed with %d", ret);
+        if(requeueTransaction() < 0) {
+            error_log("No memory to keep the failed transaction, failing metadata writes from now on");
+            journal_failed = 1;
+        }
+        pthread_mutex_unlock(&journal_lock);
+        pthread_mutex_unlock(&commit_lock);
+        return ret;
+    }
+    dropEntries(&committing);
+    uint64_t *freed = committing.freed, freed_count = committing.freed_count, i, released = 0;
+    memset(&committing, 0, sizeof(committing));
+    commits_done = number;
+    pthread_mutex_unlock(&journal_lock);
+
+    // the frees are durable now. Blocks no replay writes to can be handed out again at once,
+    // the rest wait for the tail to move past the records holding them.
+    for(i = 0 ; i < freed_count ; i++) {
+        if(!wasLogged(freed[i])) {
+            clearBitofMap(freed[i]);
+            released++;
+            continue;
+        }
+        pthread_mutex_lock(&journal_lock);
+        addBlock(&releasable, &releasable_count, &releasable_cap, freed[i]);
+        pthread_mutex_unlock(&journal_lock);
+    }
+    free(freed);
+    if(released)
+        error_log("Released %lu blocks at commit", released);
+
+    pthread_mutex_unlock(&commit_lock);
+    return ret;
+}
+
+
+int journalSync() {
+    // the next commit to take the running transaction covers everything written so far
+    pthread_mutex_lock(&journal_lock);
+    uint64_t target = commits_started + 1;
+    pthread_mutex_unlock(&journal_lock);
+
+    // wait out the commit being written, a sync that arrived before it may already have started ours
+    pthread_mutex_lock(&commit_lock);
+    pthread_mutex_lock(&journal_lock);
+    int covered = commits_done >= target;
+    pthread_mutex_unlock(&journal_lock);
+    pthread_mutex_unlock(&commit_lock);
+
+    if(covered)
+        return 0;
+    return journalCommit();
+}
+
+
+void journalThrottle() {
+    if(!journaling)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    int full = recordSize(running.count) * 4 > (journal_blocks - 1) * 3;
+    pthread_mutex_unlock(&journal_lock);
+
+    if(full)
+        journalCommit();
+}
+
+
+static void *committerThread(void *arg) {
+    struct timespec deadline;
+
+    pthread_mutex_lock(&journal_lock);
+    while(!committer_stop) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += commit_interval;
+        while(!committer_stop && !commit_wanted)
+            if(pthread_cond_timedwait(&commit_wake, &journal_lock, &deadline) == ETIMEDOUT)
+                break;
+        if(committer_stop)
+            break;
+
+        commit_wanted = 0;
+        pthread_mutex_unlock(&journal_lock);
+        // nodes that can't be written stay dirty for the next round, what was written is still committed
+        sync_fs_tree();
+        journalCommit();
+        pthread_mutex_lock(&journal_lock);
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return NULL;
+}
+
+void journalStart() {
+    if(!committer_started && !pthread_create(&committer, NULL, committerThread, NULL))
+        committer_started = 1;
+}
+
+
+int journalWrite(uint64_t blocknr, void *block) {
+    if(!journaling)
+        return writeBlock(blocknr, block);
+
+    int ret = 0;
+    pthread_mutex_lock(&journal_lock);
+    if(journal_failed) {
+        pthread_mutex_unlock(&journal_lock);
+        return -EIO;
+    }
+    int64_t i = findEntry(&running, blocknr);
+    if(i >= 0)
+        memcpy(running.entries[i].data, block, BLOCK_SIZE);
+    else if((ret = addEntry(&running, blocknr, block)) < 0) {
+        // writing it in place would put half an operation on disk, and committing without it would too
+        error_log("No memory to journal block %lu, failing metadata writes from now on", blocknr);
+        journal_failed = 1;
+    }
+
+    // commit early once the transaction takes half of the journal
+    if(recordSize(running.count) * 2 > journal_blocks && !commit_wanted) {
+        commit_wanted = 1;
+        pthread_cond_signal(&commit_wake);
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return ret < 0 ? ret : BLOCK_SIZE;
+}
+
+
+int journalRead(uint64_t blocknr, void *block) {
+    if(!journaling)
+        return 0;
+
+    int64_t i;
+    int found = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    if((i = findEntry(&running, blocknr)) >= 0) {
+        memcpy(block, running.entries[i].data, BLOCK_SIZE);
+        found = 1;
+    }
+    else if((i = findEntry(&committing, blocknr)) >= 0) {
+        memcpy(block, committing.entries[i].data, BLOCK_SIZE);
+        found = 1;
+    }
+    pthread_mutex_unlock(&journal_lock);
+
+    return found;
+}
+
+
+int journalPending(uint64_t blocknr, uint64_t count) {
+    if(!journaling)
+        return 0;
+
+    uint64_t i;
+    int found = 0;
+
+    pthread_mutex_lock(&journal_lock);
+    for(i = 0 ; i < count && !found && (running.count || committing.count) ; i++)
+        found = findEntry(&running, blocknr + i) >= 0 || findEntry(&committing, blocknr + i) >= 0;
+    pthread_mutex_unlock(&journal_lock);
+
+    return found;
+}
+
+
+void journalFree(uint64_t blocknr) {
+    if(!journaling) {
+        clearBitofMap(blocknr);
+        return;
+    }
+
+    pthread_mutex_lock(&journal_lock);
+    if(addBlock(&running.freed, &running.freed_count, &running.freed_cap, blocknr) < 0)
+        error_log("No memory to release block %lu, leaking it", blocknr);
+    pthread_mutex_unlock(&journal_lock);
+}
+
+
+uint64_t journalReclaim() {
+    if(!journaling)
+        return 0;
+
+    uint64_t released = 0;
+
+    pthread_mutex_lock(&commit_lock);
+    pthread_mutex_lock(&journal_lock);
+    uint64_t releasing = releasable_count;
+    pthread_mutex_unlock(&journal_lock);
+
+    if(releasing) {
+        released = releasing;
+        if(checkpoint(head) < 0)
+            released = 0;
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    error_log("%s released %lu blocks", __func__, released);
+    return released;
+}
+
+
+// Checksum the transaction whose first descriptor is at block `pos` of the region. Returns the block after its commit block, or 0 if it is incomplete or torn.
+static uint64_t checkRecord(uint64_t pos, uint64_t txn, uint8_t *buf) {
+    uint64_t hash = 14695981039346656037ULL, k, n;
+    journal_block *jb = (journal_block *)buf;
+
+    while(pos < journal_blocks) {
+        if(rawReadBlock(journal_start + pos, buf) < 0 || jb->magic != JOURNAL_MAGIC || jb->seq != txn)
+            return 0;
+
+        if(jb->type == JOURNAL_COMMIT)
+            return jb->value == hash ? pos + 1 : 0;
+        if(jb->type != JOURNAL_DESCRIPTOR || jb->value > JOURNAL_TAGS || pos + 1 + jb->value > journal_blocks)
+            return 0;
+
+        hash = blockHash(hash, buf);
+        n = jb->value;
+        for(k = 1 ; k <= n ; k++) {
+            if(rawReadBlock(journal_start + pos + k, buf) < 0)
+                return 0;
+            hash = blockHash(hash, buf);
+        }
+        pos += n + 1;
+    }
+    return 0;
+}
+
+// Copy the blocks of the checked transaction at `pos` to their real places
+static int replayRecord(uint64_t pos, uint64_t end, uint8_t *desc, uint8_t *buf) {
+    journal_block *jb = (journal_block *)desc;
+    uint64_t k;
+    int ret;
+
+    while(pos + 1 < end) {
+        if((ret = rawReadBlock(journal_start + pos, desc)) < 0)
+            return ret;
+        for(k = 0 ; k < jb->value ; k++) {
+            if((ret = rawReadBlock(journal_start + pos + 1 + k, buf)) < 0)
+                return ret;
+            if((ret = rawWriteBlock(((uint64_t *)(desc + sizeof(journal_block)))[k], buf)) < 0)
+                return ret;
+        }
+        pos += jb->value + 1;
+    }
+    return 0;
+}
+
+
+int openJournal(int replay_only) {
+    error_log("%s called", __func__);
+
+    readDisk(&journal_start, sizeof(journal_start), JOURNAL_SB_START);
+    readDisk(&journal_blocks, sizeof(journal_blocks), JOURNAL_SB_BLOCKS);
+    if(!journal_start || journal_blocks < 3) {
+        error_log("No journal on this disk");
+        journal_blocks = 0;
+        return 0;
+    }
+
+    uint8_t *buf = (uint8_t *)malloc(BLOCK_SIZE), *desc = (uint8_t *)malloc(BLOCK_SIZE);
+    journal_block *h = (journal_block *)buf;
+    uint64_t pos = 1, end, replayed = 0;
+    int ret = -ENOMEM, unclean = 0;
+
+    for(logged_size = 1 ; logged_size < journal_blocks * 2 ; logged_size <<= 1);
+    logged = (uint64_t *)calloc(logged_size, sizeof(uint64_t));
+    if(!buf || !desc || !logged)
+        goto out;
+
+    if((ret = rawReadBlock(journal_start, buf)) < 0)
+        goto out;
+
+    seq = 1;
+    if(h->magic == JOURNAL_MAGIC && (h->type == JOURNAL_HEADER || h->type == JOURNAL_CLEAN)) {
+        pos = h->value;
+        seq = h->seq;
+        unclean = h->type == JOURNAL_HEADER;
+    }
+
+    // every transaction from the tail on that is complete was committed, apply them in order
+    while(pos < journal_blocks && (end = checkRecord(pos, seq, buf))) {
+        if((ret = replayRecord(pos, end, desc, buf)) < 0)
+            goto out;
+        error_log("Replayed transaction %lu", seq);
+        pos = end;
+        seq++;
+        replayed++;
+    }
+
+    if(replayed && (ret = flushDisk()) < 0)
+        goto out;
+
+    // mounted, until closeJournal says otherwise
+    head = 1;
+    if((ret = writeHeader(head, seq, JOURNAL_HEADER)) < 0)
+        goto out;
+
+    journaling = !replay_only;
+    error_log("Journal of %lu blocks at %lu, replayed %lu transactions, unclean = %d", journal_blocks, journal_start, replayed, unclean);
+    ret = unclean;
+
+out:
+    free(buf);
+    free(desc);
+    return ret;
+}
+
+
+void closeJournal() {
+    error_log("%s called", __func__);
+
+    pthread_mutex_lock(&journal_lock);
+    committer_stop = 1;
+    pthread_cond_signal(&commit_wake);
+    pthread_mutex_unlock(&journal_lock);
+    if(committer_started)
+        pthread_join(committer, NULL);
+    committer_started = 0;
+
+    if(!journal_blocks)
+        return;
+
+    if(journaling) {
+        int ret = journalCommit();
+
+        // everything in place, nothing left to replay
+        pthread_mutex_lock(&commit_lock);
+        if(ret >= 0 && checkpoint(1) < 0)
+            error_log("Could not empty the journal");
+        journaling = 0;
+        pthread_mutex_unlock(&commit_lock);
+
+        if(ret < 0) {
+            // leave the header as it is, whatever reached the journal is replayed and the bitmap rebuilt at the next mount
+            error_log("Last commit failed, leaving the journal unclean");
+            free(logged);
+            logged = NULL;
+            logged_size = 0;
+            return;
+        }
+    }
+
+    // frees waiting in the running transaction can't exist, nothing runs at unmount
+    saveBitMap();
+
+    // the bitmap is exact now, the next mount needn't check it
+    if(flushCache() < 0 || flushDisk() < 0 || writeHeader(1, seq, JOURNAL_CLEAN) < 0)
+        error_log("Could not mark the journal clean");
+
+    free(logged);
+    logged = NULL;
+    logged_size = 0;
+}
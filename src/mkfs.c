@@ -5,8 +5,10 @@
 	4. Write size of bitmap (in blocks) required for entire disk in next 64 bits
 	5. Create root ("/") directory
 	6. Mark blocks used by superblock, bitmap and root directory as 1 in bitmap
-	7. Write bitmap to file
-	8. Write root node to file
+	7. Reserve the journal region right after the root directory and record it in the superblock
+	8. Record the number of inodes per block of the inode table in the superblock
+	9. Write bitmap to file
+	10. Write root node to file, as the first inode of the first inode table block
 */
 
 #include<stdio.h>
@@ -17,6 +19,7 @@
 #include "tree.h"
 #include "disk.h"
 #include "bitmap.h"
+#include "journal.h"
 
 // macros for backward compatibility
 #define openDisk(x) openDisk(x, 0)
@@ -92,9 +95,12 @@ int main(int argc, char **argv){
 	error_log("Constructing block for root node!\n");
 	
 	fs_tree_node *root = node_exists("/");
-	root->inode_no = firstFreeBlock;
+	root->inode_no = firstFreeBlock * INODES_PER_BLOCK;
 	
-	constructBlock(root, &buf);		// Create block for root node
+	if(constructBlock(root, &buf) < 0) {	// Create block for root node, the other records of the block are zero and free
+		perror("No memory for root node");
+		exit(0);
+	}
 	error_log("Done constructing block for root node!\n");
 	output_node(*root);
 
@@ -102,6 +108,17 @@ int main(int argc, char **argv){
 	error_log("Done writing block for root node!\n");
 	
 	setBitofMap(firstFreeBlock);
+
+	// Journal region, its header block is zero so the first mount starts it empty
+	uint64_t journal[2] = { firstFreeBlock + 1, journalSize(size / BLOCK_SIZE) };
+	for(i = 0 ; i < journal[1] ; i++)
+		setBitofMap(journal[0] + i);
+	pwrite(fd, journal, sizeof(journal), JOURNAL_SB_START);
+	error_log("Journal of %lu blocks at %lu\n", journal[1], journal[0]);
+
+	uint64_t packing = INODES_PER_BLOCK;
+	pwrite(fd, &packing, sizeof(packing), INODE_SB_PACKING);
+
 	error_log("Writing bitmap to file\n");
 	for(i = 0 ; i < bmap_blocks ; i++) {
 		writeBlock(SUPERBLOCKS + i, bitmap + (i * BLOCK_SIZE));
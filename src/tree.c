@@ -1,8 +1,21 @@
+#define _GNU_SOURCE         // writer preferring rwlock initializer
 #include "tree.h"
+#include "journal.h"
 
 // Root
 fs_tree_node *root;
 
+uint64_t node_budget = DEFAULT_NODE_BUDGET;
+uint64_t tree_nodes = 0;
+static uint64_t tree_clock = 0;         // ticks on every directory lookup, for `last_used`
+
+// writers are preferred, else a steady stream of lookups would keep creates and removes waiting forever
+pthread_rwlock_t tree_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+// Marks a child_index slot whose child was removed, so probing continues past it
+static fs_tree_node index_deleted;
+#define INDEX_DELETED (&index_deleted)
+
 // Error logging for THIS MODULE, helps differentiate from logging of other modules
 // Prints errors and logging info to STDOUT
 // Passes format strings and args to vprintf, basically a wrapper for printf
@@ -32,15 +45,29 @@ int destroy_node(fs_tree_node *node) {
     
     if(node->children != NULL)
         free(node->children);
+    free(node->ch_inodes);
+    node->ch_inodes = NULL;
+    free(node->child_index);
+    node->child_index = NULL;
+    node->index_size = node->index_used = 0;
     error_log("Erased children");
     
     node->parent = NULL;
     error_log("Erased parent");
 
-    if(node->data != NULL)
-        deallocate(node);
+    dropDirtyBlocks(node, 0);
+    node->data_size = 0;
     error_log("Erased data");
+
+    free(node->extents);
+    free(node->ext_blocks);
+    node->extents = NULL;
+    node->ext_blocks = NULL;
+    node->extent_count = node->ext_block_count = 0;
+    error_log("Erased extents");
     
+    pthread_rwlock_destroy(&node->lock);
+    __atomic_sub_fetch(&tree_nodes, 1, __ATOMIC_RELAXED);
     //free(node);   // causes double free error
     error_log("Returning");
     return 0;
@@ -48,7 +75,7 @@ int destroy_node(fs_tree_node *node) {
 
 
 void output_node(fs_tree_node node) {
-    error_log("Type : %d\nName : %s\nfullname : %s\nuid : %d\ngid : %d\nperms : %d\nnlinks : %d\nparent : %p\nchildren : %p\nlen : %u\ndata : %p\ndata_size : %lu\nblock_count : %lu\ninode_no : %lu\nst_atim : %s\nst_mtim : %s\nst_ctim : %s\n", node.type, node.name, node.fullname, node.uid, node.gid, node.perms, node.nlinks, node.parent, node.children, node.len, node.data, node.data_size, node.block_count, node.inode_no, ctime(&node.st_atim.tv_sec), ctime(&node.st_mtim.tv_sec), ctime(&node.st_ctim.tv_sec));
+    error_log("Type : %d\nName : %s\nfullname : %s\nuid : %d\ngid : %d\nperms : %d\nnlinks : %d\nparent : %p\nchildren : %p\nlen : %u\ndirty : %u\ndata_size : %lu\nblock_count : %lu\ninode_no : %lu\nst_atim : %s\nst_mtim : %s\nst_ctim : %s\n", node.type, node.name, node.fullname, node.uid, node.gid, node.perms, node.nlinks, node.parent, node.children, node.len, node.dirty_count, node.data_size, node.block_count, node.inode_no, ctime(&node.st_atim.tv_sec), ctime(&node.st_mtim.tv_sec), ctime(&node.st_ctim.tv_sec));
 }
 
 
@@ -69,13 +96,29 @@ int init_fs() {
 
     root->children = NULL;
     root->ch_inodes = NULL;
+    root->child_index = NULL;
+    root->index_size = root->index_used = 0;
     root->len = 0;
+    root->loaded = 1;
+    root->stub = 0;
+    root->last_used = 0;
+    pthread_rwlock_init(&root->lock, NULL);
     root->nlinks = 2;
     root->parent = NULL;
-    root->data = NULL;
+    root->dirty = NULL;
+    root->dirty_count = 0;
+    root->dirty_cap = 0;
+    root->meta_dirty = 1;
     root->data_size = 0;
     root->block_count = 0;
 
+    root->extents = NULL;
+    root->extent_count = 0;
+    root->ext_blocks = NULL;
+    root->ext_block_count = 0;
+    root->tail = 0;
+
+    tree_nodes = 1;
     return 0;
 }
 
@@ -85,10 +128,12 @@ int dfs_dispatch(fs_tree_node *curr, int (*foo)(fs_tree_node *)) {
 
     int i = 0;
     if(curr->len > 0 && curr->type == 2) {         // if curr has children and is directory
+        load_children(curr);
         error_log("Has %d children, curr->children is %p", curr->len, curr->children);
-        for(i = 0 ; i < curr->len ; i++)        // call dsf_dispatch on each child
-            if(curr->children[i]->type == 2)                    //if it is a directory, only dirs can have children
-                dfs_dispatch(curr->children[i], foo);
+        for(i = 0 ; i < curr->len ; i++) {      // call dsf_dispatch on each child, files end up with foo applied directly
+            load_node(curr->children[i]);
+            dfs_dispatch(curr->children[i], foo);
+        }
     }
 
     // when a node with no children is found
@@ -104,9 +149,12 @@ int bfs_dispatch(fs_tree_node *curr, int (*foo)(fs_tree_node *)) {
 
     int i = 0;
     if(curr->len > 0 && curr->type == 2) {         // if curr has children and is directory
+        load_children(curr);
         error_log("Has %d children, curr->children is %p", curr->len, curr->children);
-        for(i = 0 ; i < curr->len ; i++)        // call foo on each child
+        for(i = 0 ; i < curr->len ; i++) {      // call foo on each child
+            load_node(curr->children[i]);
             foo(curr->children[i]);
+        }
 
         for(i = 0 ; i < curr->len ; i++)        // call bsf_dispatch on each child
             bfs_dispatch(curr->children[i], foo);
@@ -116,111 +164,211 @@ int bfs_dispatch(fs_tree_node *curr, int (*foo)(fs_tree_node *)) {
 }
 
 
-fs_tree_node *node_exists(const char *path) {
-    error_log("%s called!", __func__);
-    error_log("Checking if : %s : exists", path);
+// FNV-1a hash of the `len` characters of a child name
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
 
-    int s = 1, e = 0, l = strlen(path), sublen = 0;
-    int i, j, found = 0;
-    char *sub = NULL;
-    fs_tree_node *curr = root;
-    
-    if(!strcmp(path, "/")) {
-        error_log("%s returning with %p!", __func__, curr);
-        return curr;
+    while(len--) {
+        hash ^= (uint8_t)*name++;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    do {
-        found = 0;
-        for(i = s ; i < l ; i++) {
-            if(path[i] == '/') {
-                e = i;
-                break;
-            }
+// Does child `node` have the name in the `len` characters at `name`
+static int name_matches(fs_tree_node *node, const char *name, size_t len) {
+    return !strncmp(node->name, name, len) && node->name[len] == 0;
+}
+
+
+// Rebuild the index of `dir` with `size` slots from its children array, dropping deleted markers
+static int rebuild_child_index(fs_tree_node *dir, uint32_t size) {
+    fs_tree_node **slots = (fs_tree_node **)calloc(size, sizeof(fs_tree_node *));
+    if(!slots) {
+        error_log("Error allocating child index of %p", dir);
+        return -ENOMEM;
+    }
+
+    uint32_t i, slot;
+    for(i = 0 ; i < dir->len ; i++) {
+        slot = name_hash(dir->children[i]->name, strlen(dir->children[i]->name)) & (size - 1);
+        while(slots[slot])
+            slot = (slot + 1) & (size - 1);
+        slots[slot] = dir->children[i];
+    }
+
+    free(dir->child_index);
+    dir->child_index = slots;
+    dir->index_size = size;
+    dir->index_used = dir->len;
+
+    error_log("Child index of %p rebuilt with %u slots for %u children", dir, size, dir->len);
+    return 0;
+}
+
+
+fs_tree_node *find_child(fs_tree_node *dir, const char *name, size_t len) {
+    fs_tree_node *child = NULL;
+    uint32_t i, slot;
+
+    if(len >= sizeof(dir->name))
+        return NULL;
+
+    if(load_children(dir) < 0)
+        return NULL;
+    // lookups run in parallel, only the tick has to be exact
+    __atomic_store_n(&dir->last_used, __atomic_add_fetch(&tree_clock, 1, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+
+    if(!dir->child_index) {
+        for(i = 0 ; i < dir->len && !child ; i++) {
+            if(name_matches(dir->children[i], name, len))
+                child = dir->children[i];
+        }
+    }
+    else {
+        slot = name_hash(name, len) & (dir->index_size - 1);
+        while(dir->child_index[slot] && !child) {
+            if(dir->child_index[slot] != INDEX_DELETED && name_matches(dir->child_index[slot], name, len))
+                child = dir->child_index[slot];
+            slot = (slot + 1) & (dir->index_size - 1);
         }
+    }
+
+    if(child && load_node(child) < 0)
+        return NULL;
+    return child;
+}
 
-        if(i == l)
-            e = l;
 
-        if(path[s] == '/')
-            s += 1;
+int index_child(fs_tree_node *dir, fs_tree_node *child) {
+    if(!dir->child_index && dir->len < CHILD_INDEX_MIN)
+        return 0;
 
-        sublen = e - s + 1;
-        if(sublen > 0) {
-            error_log("Length of part: %d", sublen);
-            sub = (char *)malloc(sizeof(char) * sublen);
-            sub[sublen - 1] = 0;
+    // keep at most 3/4 of the slots in use, rebuilding also clears out deleted markers
+    if(!dir->child_index || (dir->index_used + 1) * 4 > dir->index_size * 3) {
+        uint32_t size = 16;
+        while(size < dir->len * 2)
+            size *= 2;
+        return rebuild_child_index(dir, size);       // children already holds `child`
+    }
 
-            for(i = s, j = 0 ; i < e ; i++, j++)
-                sub[j] = path[i];
+    uint32_t slot = name_hash(child->name, strlen(child->name)) & (dir->index_size - 1);
+    while(dir->child_index[slot] && dir->child_index[slot] != INDEX_DELETED)
+        slot = (slot + 1) & (dir->index_size - 1);
 
-            error_log("Part found : %s", sub);
-            error_log("Searching for part in %d children!", curr->len);
+    if(!dir->child_index[slot])
+        dir->index_used++;
+    dir->child_index[slot] = child;
+    return 0;
+}
 
-            for(i = 0 ; i < curr->len ; i++) {
-                if(!strcmp(((curr->children)[i])->name, sub)) {
-                    curr = curr->children[i];
-                    error_log("curr changed to %p", curr);
-                    found = 1;
-                    break;
-                }
-            }
-            error_log("Done searching");
-            if(!sub)
-                free(sub);
-            if(!found) {
-                error_log("%s returning with 0 not found!", __func__);
-                return 0;
-            }
+
+void unindex_child(fs_tree_node *dir, fs_tree_node *child) {
+    if(!dir->child_index)
+        return;
+
+    uint32_t slot = name_hash(child->name, strlen(child->name)) & (dir->index_size - 1);
+    while(dir->child_index[slot]) {
+        if(dir->child_index[slot] == child) {
+            dir->child_index[slot] = INDEX_DELETED;
+            return;
         }
-        else {
+        slot = (slot + 1) & (dir->index_size - 1);
+    }
+}
+
+
+// Resolve the first `len` characters of `path` from the root, one component at a time, without copying any of it.
+// Empty components, as in "//" or a trailing "/", are skipped. Returns NULL if any component is missing.
+static fs_tree_node *walk_path(const char *path, size_t len) {
+    fs_tree_node *curr = root;
+    const char *p = path, *end = path + len, *next;
+
+    while(p < end && curr) {
+        while(p < end && *p == '/')
+            p++;
+        if(p == end)
             break;
-        }
-        
-        s = e + 1;
 
-    }while(e != l);
-    
+        next = memchr(p, '/', end - p);
+        if(!next)
+            next = end;
+
+        error_log("Searching for part of length %ld in %d children!", next - p, curr->len);
+        curr = find_child(curr, p, next - p);
+        p = next;
+    }
+
+    return curr;
+}
+
+
+fs_tree_node *node_exists(const char *path) {
+    error_log("%s called!", __func__);
+    error_log("Checking if : %s : exists", path);
+
+    fs_tree_node *curr;
+    if(!strcmp(path, "/")) {
+        error_log("%s returning with %p!", __func__, root);
+        return root;
+    }
+
+    if((curr = dcacheLookup(path))) {
+        error_log("%s returning with cached %p!", __func__, curr);
+        return curr;
+    }
+
+    curr = walk_path(path, strlen(path));
+    if(!curr) {
+        error_log("%s returning with 0 not found!", __func__);
+        return 0;
+    }
+
+    dcacheInsert(path, curr);
     error_log("%s returning with %p!", __func__, curr);
     return curr;
 }
 
 
+// Take back `child`, just added as the last child of `parent` by add_fs_tree_node, after it could not be written
+static void unadd_child(fs_tree_node *parent, fs_tree_node *child) {
+    unindex_child(parent, child);
+    parent->len -= 1;
+    if(child->type == 2)
+        parent->nlinks -= 1;
+    dcacheInvalidate(child->fullname, 0);
+
+    freeInode(child->inode_no);
+    pthread_rwlock_destroy(&child->lock);
+    free(child->fullname);
+    free(child);
+    __atomic_sub_fetch(&tree_nodes, 1, __ATOMIC_RELAXED);
+}
+
+
 fs_tree_node *add_fs_tree_node(const char *path, uint8_t type) {
     error_log("%s called! path = %s \t type=%d", __func__, path, type);
 
     fs_tree_node *curr = root;
-    int pathLength = strlen(path), sublen = 0;
-    int i, j;
-    char *temp = (char *)malloc(sizeof(char) * (pathLength + 1));     //to store path until one level higher than path given
-    strcpy(temp, path);
-    
-    for(i = pathLength - 1 ; temp[i] != '/' ; i--);     //find first / from back of path
-    temp[i] = 0;
-    i += 1;
-
-    if(i == 1) {  //if root's child
-        error_log("Found to be root's child!");
-        strcpy(temp, "/");
-    }
-
-    sublen = (pathLength - i + 1);
-    char *fileName = (char *)malloc(sizeof(char) * sublen);
-    for(j = 0 ; i < pathLength ; i++, j++)                  //extract name of file from full path   
-        fileName[j] = path[i];
-    fileName[sublen - 1] = 0;
+    size_t pathLength = strlen(path);
+    const char *fileName = strrchr(path, '/') + 1;        // name of file is everything after the last /
+    size_t nameLength = pathLength - (fileName - path);
 
     error_log("Name of file : %s", fileName);
+    if(nameLength >= sizeof(curr->name)) {
+        error_log("Returning with error ENAMETOOLONG");
+        return (fs_tree_node *)(-ENAMETOOLONG);
+    }
 
-    temp[i] = 0;
-    error_log("Checking if path : %s : exists", temp);
-
-    if((curr = node_exists(temp))) {
+    // parent is everything before the last /, the root for root's children
+    if((curr = walk_path(path, fileName - 1 - path))) {
         // FUSE checks for entire path to exist (and makes sure it will exist when this called)
         // Hence this block will usually be executed
 
         error_log("Path found to exist with %d children!", curr->len);
         fs_tree_node *parent = curr;
+        if(load_children(parent) < 0)
+            return (fs_tree_node *)(-ENOMEM);
 
         curr->len += 1;
         curr->children = realloc(curr->children, sizeof(fs_tree_node *) * curr->len);
@@ -229,24 +377,34 @@ fs_tree_node *add_fs_tree_node(const char *path, uint8_t type) {
 
         //now curr is child
 
-        curr->inode_no = findFirstFreeBlock();
-        if(curr->inode_no == -1) {
+        // inode next to its last sibling or its parent, reserved before data blocks are allocated
+        curr->inode_no = allocInode(parent->len > 1 ? parent->ch_inodes[parent->len - 2] : parent->inode_no);
+        if(!curr->inode_no) {
             error_log("Returning with error ENOSPC");
+            free(curr);
+            parent->len -= 1;
             return (fs_tree_node *)(-ENOSPC);
         }
         
-        //curr->name = (char *)malloc(sizeof(char) * sublen);     //add name to FS node
-        strcpy(curr->name, fileName);
+        memcpy(curr->name, fileName, nameLength + 1);     //add name to FS node
 
         curr->fullname = (char *)malloc(sizeof(char) * (pathLength + 1));       //add full name to FS node
         strcpy(curr->fullname, path);
 
         curr->children = NULL;
         curr->ch_inodes = NULL;
+        curr->child_index = NULL;
+        curr->index_size = curr->index_used = 0;
 
         curr->type = type;
         curr->len = 0;
+        curr->loaded = 1;
+        curr->stub = 0;
+        curr->last_used = 0;
+        pthread_rwlock_init(&curr->lock, NULL);
         curr->parent = parent;
+        index_child(parent, curr);
+        __atomic_add_fetch(&tree_nodes, 1, __ATOMIC_RELAXED);
 
         void *temp = realloc(parent->ch_inodes, parent->len * sizeof(parent->inode_no));
         if(!temp) {
@@ -257,14 +415,27 @@ fs_tree_node *add_fs_tree_node(const char *path, uint8_t type) {
         (parent->ch_inodes)[parent->len - 1] = curr->inode_no;
         error_log("(parent->ch_inodes)[parent->len - 1] = %lu", (parent->ch_inodes)[parent->len - 1]);
     }
+    else {
+        error_log("Returning with error ENOENT, parent does not exist");
+        return (fs_tree_node *)(-ENOENT);
+    }
 
     curr->uid = getuid();
     curr->gid = getgid();
 
-    curr->data = NULL;
+    curr->dirty = NULL;
+    curr->dirty_count = 0;
+    curr->dirty_cap = 0;
+    curr->meta_dirty = 1;
     curr->data_size = 0;
     curr->block_count = 0;
 
+    curr->extents = NULL;
+    curr->extent_count = 0;
+    curr->ext_blocks = NULL;
+    curr->ext_block_count = 0;
+    curr->tail = 0;
+
     time(&(curr->st_ctim).tv_sec);
     curr->st_mtim = curr->st_atim = curr->st_ctim;
 
@@ -282,27 +453,26 @@ fs_tree_node *add_fs_tree_node(const char *path, uint8_t type) {
     }
 
     error_log("FS Node added at %p", curr);
-    if(!temp)
-        free(temp);
-    if(!fileName)
-        free(fileName);
 
     
     error_log("Going to write to disk");
-    void *buf = NULL;
-    error_log("buf = %p", buf);
-    int blocks_to_write = constructBlock(curr, &buf);
-    error_log("Constructed block, bug = %p", buf);
-    diskWriter(buf, blocks_to_write, curr->inode_no);
-    error_log("Wrote to disk buf = %p", buf);
-    saveBitMap();
-
-    //free(buf); // throws error "invalid pointer" = reason unkown
+    fs_tree_node *parent = curr->parent;
+    int64_t ret = diskWriter(curr);
+    if(ret < 0) {
+        error_log("Could not write the new node, error %ld", ret);
+        unadd_child(parent, curr);
+        return (fs_tree_node *)ret;
+    }
+    error_log("Wrote to disk");
     
     error_log("Starting on parent");
-    blocks_to_write = constructBlock(curr->parent, &buf);
-    error_log("Constructed parent block");
-    diskWriter(buf, blocks_to_write, curr->parent->inode_no);
+    ret = diskWriter(parent);
+    if(ret < 0) {
+        // the parent stays dirty and is rewritten without the child next time
+        error_log("Could not write the parent, error %ld", ret);
+        unadd_child(parent, curr);
+        return (fs_tree_node *)ret;
+    }
     error_log("Rewrote parent to disk");
 
     return curr;
@@ -326,7 +496,9 @@ int remove_fs_tree_node(const char *path) {
 
     error_log("Deleting node at %p, child of %p", toDelete, parent);
 
-    uint64_t next = toDelete->inode_no;
+    dcacheInvalidate(path, toDelete->type == 2);
+    unindex_child(parent, toDelete);
+    dfs_dispatch(toDelete, &freeNodeBlocks);
     dfs_dispatch(toDelete, &destroy_node);
 
     for(i = 0 ; i < parent->len ; i++) {
@@ -346,22 +518,8 @@ int remove_fs_tree_node(const char *path) {
     
     --(parent->len);
 
-    void *buf = malloc(BLOCK_SIZE);
-    error_log("Disk clear : next = %lu", next);
-    while(next) {
-        clearBitofMap(next);
-        readBlock(next, buf);
-        memcpy(&next, buf + BLOCK_SIZE - sizeof(next), sizeof(next));
-        error_log("NEXT = %lu", next);
-    }
-    error_log("Done");
-    if(!buf)
-        free(buf);
-
     error_log("Rewriting parent now");
-    void *buf2;
-    uint64_t ret = constructBlock(parent, &buf2);
-    diskWriter(buf2, ret, parent->inode_no);
+    diskWriter(parent);
 
     error_log("Returning with 0");
     return 0;
@@ -381,12 +539,30 @@ int copy_nodes(fs_tree_node *from, fs_tree_node *to) {
     to->ch_inodes = from->ch_inodes;
     //to->inode_no = from->inode_no;
     to->len = from->len;                       //number of children
-
-    to->data = from->data;						//data for read and write
+    to->child_index = from->child_index;        // names of the children do not change
+    to->index_size = from->index_size;
+    to->index_used = from->index_used;
+    to->loaded = from->loaded;
+    to->last_used = from->last_used;
+
+    uint32_t i;
+    for(i = 0 ; to->children && i < to->len ; i++)
+        to->children[i]->parent = to;
+
+    to->dirty = from->dirty;						//data not yet written
+    to->dirty_count = from->dirty_count;
+    to->dirty_cap = from->dirty_cap;
+    to->meta_dirty = 1;
     to->data_size = from->data_size;						//size of data
-    error_log("COPYING DATA %d : %10s : %10s", to->data_size, to->data, from->data);
+    error_log("COPYING DATA %d", to->data_size);
     to->block_count = from->block_count;               // number of blocks
 
+    to->extents = from->extents;                // data blocks move along with the data
+    to->extent_count = from->extent_count;
+    to->ext_blocks = from->ext_blocks;
+    to->ext_block_count = from->ext_block_count;
+    to->tail = from->tail;
+
     to->st_atim = from->st_atim;            /* time of last access */
     to->st_mtim = from->st_mtim;            /* time of last modification */
     to->st_ctim = from->st_ctim;            /* time of last status change */
@@ -398,54 +574,554 @@ int copy_nodes(fs_tree_node *from, fs_tree_node *to) {
 int load_fs(int diskfd) {
     error_log("%s called with diskfd %d", __func__, diskfd);
     uint64_t size;
-    lseek(diskfd, 0, SEEK_SET);
-    read(diskfd, &size, sizeof(size));
+    readDisk(&size, sizeof(size), 0);
     error_log("Size of disk : %lu", size);
 
     loadBitMap(diskfd);
     print_bitmap();
 
-    uint64_t toRead = ((bmap_size / BLOCK_SIZE + 1) + SUPERBLOCKS);
+    // disks made before inodes were packed have 0 here and one inode per block
+    readDisk(&inodes_per_block, sizeof(inodes_per_block), INODE_SB_PACKING);
+    if(!inodes_per_block)
+        inodes_per_block = 1;
+    if(inodes_per_block > 16 || INODE_SIZE < NODE_SIZE) {
+        error_log("Unsupported %lu inodes per block", inodes_per_block);
+        return -EINVAL;
+    }
+
+    // root is the first inode of the block after the bitmap
+    uint64_t toRead = ((bmap_size / BLOCK_SIZE + 1) + SUPERBLOCKS) * inodes_per_block;
     error_log("toRead = %d", toRead);
 
     // Load root node
     root = diskReader(toRead);
+    if((int64_t)root < 0) {
+        int ret = (int64_t)root;
+        error_log("Could not read root node, error %d", ret);
+        root = NULL;
+        return ret;
+    }
     error_log("Root node at %p", root);
     error_log("With children %u", root->len);
     
     root->fullname = NULL;
     root->parent = NULL;
     root->children = NULL;
-    root->data = NULL;
-    root->block_count = 0;
+    tree_nodes = 1;
 
     output_node(*root);
 
-    fill_fs_tree(root);
+    // everything below the root is read on first use
 
     error_log("Done loading");
     return 0;
 }
 
 
-void fill_fs_tree(fs_tree_node *root) {
-    error_log("%s called with root %p with name %s", __func__, root, root->name);
-    uint64_t i;
-    root->fullname = NULL;
-    root->children = NULL;
-    root->data = NULL;
-    root->block_count = 0;
+// Node for a child known only from its directory entry
+static fs_tree_node *stub_node(dir_entry *entry) {
+    fs_tree_node *node = (fs_tree_node *)calloc(1, sizeof(fs_tree_node));
+    if(!node)
+        return NULL;
+
+    node->type = entry->type;
+    strcpy(node->name, entry->name);
+    node->inode_no = entry->inode_no;
+    node->stub = 1;
+    pthread_rwlock_init(&node->lock, NULL);
+    return node;
+}
+
 
-    root->children = (fs_tree_node **)malloc(sizeof(fs_tree_node *) * root->len);
+int load_node(fs_tree_node *node) {
+    if(!__atomic_load_n(&node->stub, __ATOMIC_ACQUIRE))
+        return 0;
 
-    for(i = 0 ; i < root->len ; i++) {
-        root->children[i] = diskReader(root->ch_inodes[i]);
-        root->children[i]->parent = root;
+    pthread_rwlock_wrlock(&node->lock);
+    if(!node->stub) {
+        pthread_rwlock_unlock(&node->lock);
+        return 0;
     }
 
-    for(i = 0 ; i < root->len ; i++) {
-        fill_fs_tree(root->children[i]);
+    fs_tree_node *full = diskReader(node->inode_no);
+    if((int64_t)full < 0) {
+        pthread_rwlock_unlock(&node->lock);
+        return (int64_t)full;
     }
-    
-    return;
-}
\ No newline at end of file
+
+    node->uid = full->uid;
+    node->gid = full->gid;
+    node->perms = full->perms;
+    node->nlinks = full->nlinks;
+    node->len = full->len;
+    node->data_size = full->data_size;
+    node->block_count = full->block_count;
+    node->extents = full->extents;
+    node->extent_count = full->extent_count;
+    node->ext_blocks = full->ext_blocks;
+    node->ext_block_count = full->ext_block_count;
+    node->tail = full->tail;
+    node->st_atim = full->st_atim;
+    node->st_mtim = full->st_mtim;
+    node->st_ctim = full->st_ctim;
+
+    pthread_rwlock_destroy(&full->lock);
+    free(full);
+
+    // everything is in place before anyone walking without the lock sees it
+    __atomic_store_n(&node->stub, 0, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&node->lock);
+
+    return 0;
+}
+
+
+int load_children(fs_tree_node *dir) {
+    if(dir->type != 2 || __atomic_load_n(&dir->loaded, __ATOMIC_ACQUIRE))
+        return 0;
+
+    // several lookups can reach an unloaded directory at once, the first one loads it
+    pthread_rwlock_wrlock(&dir->lock);
+    if(dir->loaded) {
+        pthread_rwlock_unlock(&dir->lock);
+        return 0;
+    }
+
+    error_log("%s called on %p with %u children", __func__, dir, dir->len);
+
+    int64_t i, n;
+    uint64_t *ch_inodes = (uint64_t *)malloc(sizeof(uint64_t) * (dir->len ? dir->len : 1));
+    dir_entry *entries = (dir_entry *)malloc(sizeof(dir_entry) * (dir->len ? dir->len : 1));
+    dir->children = (fs_tree_node **)malloc(sizeof(fs_tree_node *) * (dir->len ? dir->len : 1));
+    if(!ch_inodes || !entries || !dir->children || (n = readEntries(dir, entries)) < 0) {
+        free(ch_inodes);
+        free(entries);
+        free(dir->children);
+        dir->children = NULL;
+        pthread_rwlock_unlock(&dir->lock);
+        return -ENOMEM;
+    }
+    if(n != dir->len) {
+        error_log("Directory %p lists %ld of its %u children", dir, n, dir->len);
+        dir->len = n;
+    }
+
+    // names and types come from the entries, inodes are read on first use
+    for(i = 0 ; i < n ; i++) {
+        ch_inodes[i] = entries[i].inode_no;
+        dir->children[i] = entries[i].type ? stub_node(&entries[i]) : diskReader(entries[i].inode_no);
+        if(!dir->children[i] || (int64_t)dir->children[i] < 0) {
+            int ret = dir->children[i] ? (int64_t)dir->children[i] : -ENOMEM;
+            error_log("Could not read child %ld of %p", i, dir);
+            while(i--) {
+                free(dir->children[i]->fullname);
+                destroy_node(dir->children[i]);
+                free(dir->children[i]);
+            }
+            free(ch_inodes);
+            free(entries);
+            free(dir->children);
+            dir->children = NULL;
+            pthread_rwlock_unlock(&dir->lock);
+            return ret;
+        }
+        dir->children[i]->parent = dir;
+        __atomic_add_fetch(&tree_nodes, 1, __ATOMIC_RELAXED);      // counted as made, destroy_node takes it off again
+    }
+    free(entries);
+    free(dir->ch_inodes);
+    dir->ch_inodes = ch_inodes;
+
+    if(dir->len >= CHILD_INDEX_MIN)
+        index_child(dir, dir->children[dir->len - 1]);      // builds the whole index at once
+
+    // children are complete before anyone walking without the lock sees `loaded`
+    __atomic_store_n(&dir->loaded, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&dir->lock);
+
+    return 0;
+}
+
+
+// Can the children of `dir` be dropped from memory : nothing below it is dirty or loaded
+static int evictable(fs_tree_node *dir) {
+    uint32_t i;
+    fs_tree_node *child;
+
+    for(i = 0 ; i < dir->len ; i++) {
+        child = dir->children[i];
+        if(child->dirty_count || child->meta_dirty)
+            return 0;
+        if(child->type == 2 && child->loaded)
+            return 0;
+    }
+    return 1;
+}
+
+// Gather every loaded directory under and including `dir` whose children can be evicted
+static void collect_evictable(fs_tree_node *dir, fs_tree_node ***list, uint64_t *n, uint64_t *cap) {
+    if(dir->type != 2 || !dir->loaded)
+        return;
+
+    if(evictable(dir)) {
+        if(*n == *cap) {
+            uint64_t size = *cap ? *cap * 2 : 64;
+            fs_tree_node **temp = realloc(*list, sizeof(fs_tree_node *) * size);
+            if(!temp)
+                return;
+            *list = temp;
+            *cap = size;
+        }
+        (*list)[(*n)++] = dir;
+        return;
+    }
+
+    uint32_t i;
+    for(i = 0 ; i < dir->len ; i++)
+        collect_evictable(dir->children[i], list, n, cap);
+}
+
+static int by_last_used(const void *a, const void *b) {
+    uint64_t x = (*(fs_tree_node **)a)->last_used, y = (*(fs_tree_node **)b)->last_used;
+    return (x > y) - (x < y);
+}
+
+// Drop the children of `dir`, leaving it as it is right after `diskReader`
+static void evict_children(fs_tree_node *dir) {
+    error_log("%s called on %p with %u children", __func__, dir, dir->len);
+
+    uint32_t i;
+    for(i = 0 ; i < dir->len ; i++) {
+        free(dir->children[i]->fullname);
+        destroy_node(dir->children[i]);
+        free(dir->children[i]);
+    }
+
+    free(dir->children);
+    free(dir->child_index);
+    dir->children = NULL;
+    dir->child_index = NULL;
+    dir->index_size = dir->index_used = 0;
+    dir->loaded = 0;
+}
+
+
+void trim_fs_tree() {
+    if(!node_budget || __atomic_load_n(&tree_nodes, __ATOMIC_RELAXED) <= node_budget)
+        return;
+
+    pthread_rwlock_wrlock(&tree_lock);
+    if(tree_nodes <= node_budget) {         // another thread trimmed meanwhile
+        pthread_rwlock_unlock(&tree_lock);
+        return;
+    }
+
+    error_log("%s called with %lu nodes in memory, budget %lu", __func__, tree_nodes, node_budget);
+
+    uint64_t target = node_budget - node_budget / 4;
+    uint64_t i, n, cap = 0;
+    fs_tree_node **list = NULL;
+
+    // cached paths may point into the subtrees about to go
+    dcacheInvalidate("/", 1);
+
+    // evicting directories can make their parents evictable, so go again until under target
+    while(tree_nodes > target) {
+        n = 0;
+        collect_evictable(root, &list, &n, &cap);
+        if(!n)
+            break;
+
+        qsort(list, n, sizeof(fs_tree_node *), by_last_used);
+        for(i = 0 ; i < n && tree_nodes > target ; i++)
+            evict_children(list[i]);
+    }
+    free(list);
+
+    error_log("%s done with %lu nodes in memory", __func__, tree_nodes);
+    pthread_rwlock_unlock(&tree_lock);
+}
+
+
+// Write the dirty nodes under and including `node`, children first like dfs_dispatch but without loading anything.
+// A node that fails stays dirty, the others are still written. Returns the first error.
+static int sync_node(fs_tree_node *node) {
+    uint32_t i;
+    int ret = 0, child_ret;
+    if(node->type == 2 && __atomic_load_n(&node->loaded, __ATOMIC_ACQUIRE))
+        for(i = 0 ; i < node->len ; i++)
+            if((child_ret = sync_node(node->children[i])) < 0 && ret >= 0)
+                ret = child_ret;
+
+    pthread_rwlock_wrlock(&node->lock);
+    if(node->dirty_count || node->meta_dirty) {
+        int64_t written = diskWriter(node);
+        if(written < 0 && ret >= 0)
+            ret = written;
+    }
+    pthread_rwlock_unlock(&node->lock);
+    return ret;
+}
+
+
+int sync_fs_tree() {
+    int ret = 0;
+    pthread_rwlock_rdlock(&tree_lock);
+    if(root)
+        ret = sync_node(root);
+    pthread_rwlock_unlock(&tree_lock);
+    if(ret < 0)
+        error_log("%s could not write every node, error %d", __func__, ret);
+    return ret;
+}
+
+
+// Fill `ch_inodes` of directory `dir` from its entries, without making any nodes
+static int read_ch_inodes(fs_tree_node *dir) {
+    dir_entry *entries = (dir_entry *)malloc(sizeof(dir_entry) * (dir->len ? dir->len : 1));
+    uint64_t *ch_inodes = (uint64_t *)malloc(sizeof(uint64_t) * (dir->len ? dir->len : 1));
+    int64_t i, n;
+
+    if(!entries || !ch_inodes || (n = readEntries(dir, entries)) < 0) {
+        free(entries);
+        free(ch_inodes);
+        return -ENOMEM;
+    }
+
+    for(i = 0 ; i < n ; i++)
+        ch_inodes[i] = entries[i].inode_no;
+    free(entries);
+
+    free(dir->ch_inodes);
+    dir->ch_inodes = ch_inodes;
+    dir->len = n;
+    return 0;
+}
+
+
+// Set the bits in `map` of every block the subtree at inode `inode_no` uses, reading one inode at a time without keeping any.
+// Inodes out of range or already seen in `seen` are skipped, so a damaged tree can't loop.
+static uint64_t mark_reachable(uint64_t inode_no, uint8_t *map, uint8_t *seen) {
+    uint64_t i, b, inodes = 1, blocknr = inode_no / inodes_per_block;
+
+    if(blocknr >= bmap_size * 8 || seen[inode_no / 8] & (1 << (inode_no % 8)))
+        return 0;
+    seen[inode_no / 8] |= 1 << (inode_no % 8);
+    map[blocknr / 8] |= 1 << (blocknr % 8);
+
+    fs_tree_node *node = diskReader(inode_no);
+    if((int64_t)node < 0)
+        return inodes;
+    if(node->tail && node->tail / TAIL_SLOTS < bmap_size * 8)
+        map[node->tail / TAIL_SLOTS / 8] |= 1 << (node->tail / TAIL_SLOTS % 8);
+    for(i = 0 ; i < node->ext_block_count ; i++)
+        if(node->ext_blocks[i] < bmap_size * 8)
+            map[node->ext_blocks[i] / 8] |= 1 << (node->ext_blocks[i] % 8);
+    for(i = 0 ; i < node->extent_count ; i++)
+        for(b = node->extents[i].start ; b < node->extents[i].start + node->extents[i].length && b < bmap_size * 8 ; b++)
+            map[b / 8] |= 1 << (b % 8);
+
+    if(node->type == 2 && read_ch_inodes(node) == 0)
+        for(i = 0 ; i < node->len ; i++)
+            inodes += mark_reachable(node->ch_inodes[i], map, seen);
+
+    free(node->ch_inodes);
+    free(node->extents);
+    free(node->ext_blocks);
+    pthread_rwlock_destroy(&node->lock);
+    free(node);
+    return inodes;
+}
+
+
+int rebuild_bitmap() {
+    uint64_t i, bit, inodes, journal[2], leaked = 0, lost = 0;
+    uint8_t *map = (uint8_t *)calloc(bmap_size, 1);
+    uint8_t *seen = (uint8_t *)calloc(bmap_size, inodes_per_block);
+    if(!map || !seen) {
+        free(map);
+        free(seen);
+        return -ENOMEM;
+    }
+
+    // superblock, bitmap and the journal region are in use without any inode pointing at them
+    uint64_t reserved = (bmap_size / BLOCK_SIZE + 1) + SUPERBLOCKS;
+    for(i = 0 ; i < reserved ; i++)
+        map[i / 8] |= 1 << (i % 8);
+    readDisk(journal, sizeof(journal), JOURNAL_SB_START);
+    for(i = journal[0] ; journal[0] && i < journal[0] + journal[1] && i < bmap_size * 8 ; i++)
+        map[i / 8] |= 1 << (i % 8);
+
+    inodes = mark_reachable(root->inode_no, map, seen);
+    free(seen);
+
+    for(i = 0 ; i < bmap_size ; i++) {
+        if(map[i] == bitmap[i])
+            continue;
+        for(bit = i * 8 ; bit < i * 8 + 8 ; bit++) {
+            int used = (map[i] >> (bit % 8)) & 1;
+            if(testBitofMap(bit) == used)
+                continue;
+            if(used) {
+                setBitofMap(bit);
+                lost++;
+            }
+            else {
+                clearBitofMap(bit);
+                leaked++;
+            }
+        }
+    }
+    saveBitMap();
+    free(map);
+
+    error_log("%s found %lu inodes, released %lu leaked blocks, marked %lu blocks in use", __func__, inodes, leaked, lost);
+    return leaked;
+}
+
+
+// A chunk of children of one directory waiting to be read by a scan worker
+typedef struct scan_item {
+    fs_tree_node *dir;
+    uint32_t from, to;
+}scan_item;
+
+static scan_item *scan_queue = NULL;
+static uint64_t scan_queued = 0, scan_cap = 0;
+static uint64_t scan_pending = 0;       // chunks queued or being read
+static int scan_failed = 0;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scan_cond = PTHREAD_COND_INITIALIZER;
+
+// Queue chunks covering all children of `dir`, allocating its children array. Called with scan_lock held.
+static int scan_queue_dir(fs_tree_node *dir) {
+    dir->children = (fs_tree_node **)malloc(sizeof(fs_tree_node *) * (dir->len ? dir->len : 1));
+    if(!dir->children)
+        return -ENOMEM;
+
+    uint32_t from;
+    for(from = 0 ; from < dir->len ; from += SCAN_CHUNK) {
+        if(scan_queued == scan_cap) {
+            uint64_t size = scan_cap ? scan_cap * 2 : 256;
+            scan_item *temp = realloc(scan_queue, sizeof(scan_item) * size);
+            if(!temp)
+                return -ENOMEM;
+            scan_queue = temp;
+            scan_cap = size;
+        }
+
+        scan_queue[scan_queued].dir = dir;
+        scan_queue[scan_queued].from = from;
+        scan_queue[scan_queued].to = (dir->len - from > SCAN_CHUNK) ? from + SCAN_CHUNK : dir->len;
+        scan_queued++;
+        scan_pending++;
+    }
+
+    pthread_cond_broadcast(&scan_cond);
+    return 0;
+}
+
+static void *scan_worker(void *arg) {
+    scan_item item;
+    uint32_t i;
+    fs_tree_node *child;
+
+    pthread_mutex_lock(&scan_lock);
+    while(1) {
+        while(!scan_queued && scan_pending)
+            pthread_cond_wait(&scan_cond, &scan_lock);
+        if(!scan_queued)
+            break;
+
+        item = scan_queue[--scan_queued];
+        pthread_mutex_unlock(&scan_lock);
+
+        // disk reads of different chunks run in parallel, each slot of children is written by one worker only
+        for(i = item.from ; i < item.to ; i++) {
+            child = diskReader(item.dir->ch_inodes[i]);
+            item.dir->children[i] = child;
+            if((int64_t)child < 0) {
+                __atomic_store_n(&scan_failed, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            child->parent = item.dir;
+            if(child->type == 2 && read_ch_inodes(child) < 0)
+                __atomic_store_n(&scan_failed, 1, __ATOMIC_RELAXED);
+        }
+
+        pthread_mutex_lock(&scan_lock);
+        for(i = item.from ; i < item.to ; i++) {
+            child = item.dir->children[i];
+            if((int64_t)child >= 0 && child->type == 2 && scan_queue_dir(child) < 0)
+                scan_failed = 1;
+        }
+
+        if(!--scan_pending)
+            pthread_cond_broadcast(&scan_cond);
+    }
+    pthread_mutex_unlock(&scan_lock);
+
+    return NULL;
+}
+
+// Mark every directory under `dir` loaded, index large ones and count the nodes
+static uint64_t scan_finish(fs_tree_node *dir) {
+    uint64_t count = 1;
+    uint32_t i;
+
+    if(dir->type != 2)
+        return count;
+
+    dir->loaded = 1;
+    for(i = 0 ; i < dir->len ; i++)
+        count += scan_finish(dir->children[i]);
+
+    if(dir->len >= CHILD_INDEX_MIN)
+        index_child(dir, dir->children[dir->len - 1]);      // builds the whole index at once
+
+    return count;
+}
+
+
+int scan_fs_tree(int threads) {
+    error_log("%s called with %d threads", __func__, threads);
+
+    if(root->loaded)
+        return 0;
+    if(threads < 1)
+        threads = 1;
+
+    pthread_t *workers = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+    if(!workers)
+        return -ENOMEM;
+
+    scan_failed = 0;
+    if(read_ch_inodes(root) < 0 || scan_queue_dir(root) < 0)
+        scan_failed = 1;
+
+    int i, started = 0;
+    for(i = 0 ; i < threads && !scan_failed ; i++) {
+        if(pthread_create(&workers[i], NULL, scan_worker, NULL))
+            break;
+        started++;
+    }
+    if(!started && !scan_failed)
+        scan_worker(NULL);           // no threads could be started, scan on this one
+
+    for(i = 0 ; i < started ; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+
+    free(scan_queue);
+    scan_queue = NULL;
+    scan_queued = scan_cap = scan_pending = 0;
+
+    if(scan_failed) {
+        error_log("Scan failed, out of memory");
+        return -ENOMEM;
+    }
+
+    tree_nodes = scan_finish(root);
+    error_log("%s done with %lu nodes in memory", __func__, tree_nodes);
+    return 0;
+}